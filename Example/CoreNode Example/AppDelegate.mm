@@ -8,6 +8,7 @@
 
 #import "AppDelegate.h"
 #import "example_extension.h"
+#import "RingBenchmark.h"
 #import <CoreNode/CoreNode.h>
 
 @implementation AppDelegate
@@ -30,6 +31,12 @@
 	NSDictionary *environment = [NSDictionary dictionaryWithObjectsAndKeys:@"Environment variable set in Objective-C land", @"OBJC_ENV_VAR", nil];
 	[nodeThread setEnvironment:environment];
 
+	if (getenv("CORENODE_RING_BENCHMARK")) {
+		[[NSNotificationCenter defaultCenter] addObserverForName:NodeDidFinishLaunchingNotification object:nil queue:[NSOperationQueue mainQueue] usingBlock:^(NSNotification *note) {
+			[RingBenchmark runWithRecordCount:100000 recordSize:64];
+		}];
+	}
+
 	[nodeThread start];
 }
 
@@ -0,0 +1,18 @@
+//
+//  RingBenchmark.h
+//  CoreNode Example
+//
+//  Copyright (c) 2011 Neat.io. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+// Streams the same records into node through +[CoreNode emitEvent:...] and
+// through a NodeRingChannel and logs the throughput of each. Run the example
+// with CORENODE_RING_BENCHMARK=1 in the environment to run it at launch; the
+// last line logged is the speedup of the ring channel over emitEvent.
+@interface RingBenchmark : NSObject
+
++ (void)runWithRecordCount:(NSUInteger)count recordSize:(NSUInteger)size;
+
+@end
@@ -0,0 +1,70 @@
+//
+//  RingBenchmark.m
+//  CoreNode Example
+//
+//  Copyright (c) 2011 Neat.io. All rights reserved.
+//
+
+#import "RingBenchmark.h"
+#import <CoreNode/CoreNode.h>
+#include <mach/mach_time.h>
+#include <sched.h>
+
+typedef void (^RingBenchmarkProducer)(void);
+typedef void (^RingBenchmarkPhaseDone)(double recordsPerSecond);
+
+static double _SecondsSince(uint64_t start) {
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0) mach_timebase_info(&timebase);
+  return (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom / 1e9;
+}
+
+// Prepares node for |count| records, runs |producer| on |queue| and logs how
+// long it took until node had received all records, then calls |next| with
+// the measured throughput
+static void _RunPhase(NSString *label, NSString *ringName, NSUInteger count, NSUInteger size,
+                      dispatch_queue_t queue, RingBenchmarkProducer producer, RingBenchmarkPhaseDone next) {
+  NSArray *args = [NSArray arrayWithObjects:ringName ? (id)ringName : (id)[NSNull null],
+                   [NSNumber numberWithUnsignedInteger:count], nil];
+  [CoreNode invokeFunction:@"expect" onObjectName:@"ringBenchmark" arguments:args callback:^(NSError *error, NSArray *arguments) {
+    uint64_t start = mach_absolute_time();
+    dispatch_async(queue, producer);
+    [CoreNode invokeFunction:@"wait" onObjectName:@"ringBenchmark" arguments:nil callback:^(NSError *error, NSArray *arguments) {
+      double seconds = _SecondsSince(start);
+      NSLog(@"[ring benchmark] %@: %lu records of %lu bytes in %.3fs = %.0f records/s, %.1f MB/s",
+            label, (unsigned long)count, (unsigned long)size, seconds,
+            count / seconds, count * size / seconds / (1024.0 * 1024.0));
+      if (next) next(count / seconds);
+    }];
+  }];
+}
+
+
+@implementation RingBenchmark
+
++ (void)runWithRecordCount:(NSUInteger)count recordSize:(NSUInteger)size {
+  NSMutableData *payload = [NSMutableData dataWithLength:size];
+  NodeRingChannel *ring = [CoreNode ringChannel:@"ringBenchmark" capacity:4 * 1024 * 1024];
+  dispatch_queue_t producerQueue = dispatch_queue_create("ringbenchmark.producer", NULL);
+
+  RingBenchmarkProducer emitProducer = ^{
+    for (NSUInteger i = 0; i < count; ++i)
+      [CoreNode emitEvent:@"record" onObjectName:@"ringBenchmark" arguments:payload, nil];
+  };
+  RingBenchmarkProducer ringProducer = ^{
+    // retry whenever the ring is full
+    for (NSUInteger i = 0; i < count; ++i) {
+      while (![ring writeData:payload])
+        sched_yield();
+    }
+  };
+
+  _RunPhase(@"emitEvent", nil, count, size, producerQueue, emitProducer, ^(double emitRate) {
+    _RunPhase(@"ring channel", @"ringBenchmark", count, size, producerQueue, ringProducer, ^(double ringRate) {
+      NSLog(@"[ring benchmark] ring channel is %.1fx emitEvent (ring was full %lu times)",
+            ringRate / emitRate, (unsigned long)[ring droppedRecordCount]);
+    });
+  });
+}
+
+@end
@@ -24,9 +24,35 @@ static v8::Handle<Value> PerformNotification(const Arguments& args) {
   return Undefined();
 }
 
+// Converts NSStrings of different origins and reports how V8 stores each
+// one, so string_conversion_test.js can check which conversion path was taken
+static v8::Handle<Value> StringConversionInfo(const Arguments& args) {
+  HandleScope scope;
+  NSString *ascii = [@"" stringByPaddingToLength:256 withString:@"abc" startingAtIndex:0];
+  NSString *latin1 = [@"" stringByPaddingToLength:256 withString:@"\u00e9t\u00e9" startingAtIndex:0];
+  NSDictionary *strings = [NSDictionary dictionaryWithObjectsAndKeys:
+                           ascii, @"ascii",
+                           [NSString stringWithFormat:@"%@", ascii], @"formattedAscii",
+                           [NSMutableString stringWithString:ascii], @"mutableAscii",
+                           latin1, @"latin1",
+                           @"abc", @"short",
+                           nil];
+  Local<Object> info = Object::New();
+  for (NSString *name in strings) {
+    Local<String> value = [CoreNode v8ValueForObject:[strings objectForKey:name]]->ToString();
+    Local<Object> entry = Object::New();
+    entry->Set(String::NewSymbol("value"), value);
+    entry->Set(String::NewSymbol("external"), v8::Boolean::New(value->IsExternal()));
+    entry->Set(String::NewSymbol("externalAscii"), v8::Boolean::New(value->IsExternalAscii()));
+    info->Set(String::New([name UTF8String]), entry);
+  }
+  return scope.Close(info);
+}
+
 void example_extension_init(v8::Handle<v8::Object> target) {
   HandleScope scope;
 
   NODE_SET_METHOD(target, "sampleMethod", SampleMethod);
   NODE_SET_METHOD(target, "performNotification", PerformNotification);
+  NODE_SET_METHOD(target, "stringConversionInfo", StringConversionInfo);
 }
@@ -4,10 +4,14 @@ var coreNode = require('core_node');
 var exampleExtension = require('example_extension');
 var exampleModule = require('example_module');
 coreNode.registerObject('exampleModule', exampleModule);
+coreNode.registerObject('ringBenchmark', require('ring_benchmark'));
 
 var envVar = process.env['OBJC_ENV_VAR'];
 console.log(envVar);
 
 console.log(exampleExtension.sampleMethod());
 
-exampleExtension.performNotification();
\ No newline at end of file
+exampleExtension.performNotification();
+
+if (process.env['CORENODE_STRING_TEST'])
+  require('string_conversion_test').run();
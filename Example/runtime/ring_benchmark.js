@@ -0,0 +1,49 @@
+// Consumer side of the ring channel vs emitEvent benchmark (see
+// RingBenchmark.m). Counts records delivered through either path.
+
+var coreNode = require('core_node');
+var events = require('events');
+var util = require('util');
+
+function RingBenchmark() {
+  events.EventEmitter.call(this);
+  var expected = 0, received = 0, done = null;
+
+  function deliver(count) {
+    received += count;
+    if (done && received >= expected) {
+      var callback = done;
+      done = null;
+      callback(null, received);
+    }
+  }
+
+  // emitEvent path: one event per record
+  this.on('record', function(data) {
+    deliver(1);
+  });
+
+  // Get ready for |count| records, through the ring named |ringName| if set
+  this.expect = function(ringName, count, callback) {
+    expected = count;
+    received = 0;
+    done = null;
+    var ring = ringName ? coreNode.ringChannel(ringName) : null;
+    if (ring && !ring._benchmarkListener) {
+      ring._benchmarkListener = true;
+      ring.on('data', function(records) {
+        deliver(records.length);
+      });
+    }
+    callback(null);
+  };
+
+  // Call back once all expected records have arrived
+  this.wait = function(callback) {
+    done = callback;
+    deliver(0);
+  };
+}
+util.inherits(RingBenchmark, events.EventEmitter);
+
+module.exports = new RingBenchmark();
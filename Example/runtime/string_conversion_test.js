@@ -0,0 +1,37 @@
+// Checks that NSStrings are handed to V8 without copying where possible.
+// Run by main.js when CORENODE_STRING_TEST is set.
+
+var assert = require('assert');
+var exampleExtension = require('example_extension');
+
+function repeat(pattern, length) {
+  var s = '';
+  while (s.length < length) s += pattern;
+  return s.substr(0, length);
+}
+
+exports.run = function() {
+  var info = exampleExtension.stringConversionInfo();
+  var ascii = repeat('abc', 256);
+
+  // long ASCII strings use their own 8-bit storage as a one-byte string
+  assert.equal(info.ascii.value, ascii);
+  assert.ok(info.ascii.externalAscii, 'ASCII string was copied');
+  assert.equal(info.formattedAscii.value, ascii);
+  assert.ok(info.formattedAscii.externalAscii, 'formatted ASCII string was copied');
+
+  // mutable strings are copied first, but must still be external
+  assert.equal(info.mutableAscii.value, ascii);
+  assert.ok(info.mutableAscii.external, 'mutable string is not external');
+
+  // non-ASCII 8-bit strings must never be exposed as one-byte strings
+  assert.equal(info.latin1.value, repeat('été', 256));
+  assert.ok(info.latin1.external, 'Latin-1 string is not external');
+  assert.ok(!info.latin1.externalAscii, 'Latin-1 string exposed as ASCII');
+
+  // short strings are copied into the V8 heap
+  assert.equal(info.short.value, 'abc');
+  assert.ok(!info.short.external, 'short string is external');
+
+  console.log('[string conversion test] passed');
+};
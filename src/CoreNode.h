@@ -8,10 +8,20 @@
 
 #import "NodeThread.h"
 #import "NodeJSFunction.h"
+#import "NodeEventChannel.h"
+#import "NodeRingChannel.h"
+#import "NodeCancellationToken.h"
 
 typedef void (^NodeCallbackBlock)(NSError *error, NSArray *arguments);
 extern NSString *const NodeDidFinishLaunchingNotification;
 
+// Errors passed to callbacks are in this domain
+extern NSString * const KNodeErrorDomain;
+enum {
+  KNodeErrorInvocationTimedOut = 1,
+  KNodeErrorInvocationCancelled = 2,
+};
+
 #ifdef __cplusplus
 #import <v8.h>
 #import <node.h>
@@ -25,12 +35,38 @@ typedef void (*moduleInit)(v8::Handle<v8::Object> target);
 
 + (NodeThread *)newNodeThreadForBootstrapPath:(NSString *)bootstrapPath nodePath:(NSString *)nodePath;
 
+// Runs node on the main thread, driven by the main run loop, and calls
+// |hostMain| once node is up. See -[NodeThread runOnMainThreadWithHostMain:]
++ (int)runNodeOnMainThreadWithBootstrapPath:(NSString *)bootstrapPath nodePath:(NSString *)nodePath hostMain:(NodeHostMainBlock)hostMain;
+
 + (void)emitEvent:(NSString *)eventName onObjectName:(NSString *)objectName arguments:(id)argument, ... NS_REQUIRES_NIL_TERMINATION;
 
++ (NodeEventChannel *)eventChannel:(NSString *)eventName onObjectName:(NSString *)objectName;
+
++ (NodeRingChannel *)ringChannel:(NSString *)name capacity:(NSUInteger)capacity;
+
 + (void)invokeFunction:(NSString *)functionName onObjectName:(NSString *)objectName arguments:(NSArray *)arguments callback:(NodeCallbackBlock)callbackBlock;
 
+// Like invokeFunction:onObjectName:arguments:callback: but the invocation is
+// skipped if it has not started in node by |deadline| (nil for none) or if the
+// returned token is cancelled before then.
++ (NodeCancellationToken *)invokeFunction:(NSString *)functionName onObjectName:(NSString *)objectName arguments:(NSArray *)arguments deadline:(NSDate *)deadline callback:(NodeCallbackBlock)callbackBlock;
+
+// Number of invocations skipped so far, keyed by "timedOut" and "cancelled"
++ (NSDictionary *)shedInvocationCounts;
+
+// Mark a pure function as cacheable. Successful results of
+// invokeFunction:onObjectName:arguments:callback: are then kept for |ttl|
+// seconds (at most |maxEntries| of them) and repeated invocations with equal
+// arguments are answered immediately on the calling thread. Identical
+// invocations made while one is in flight share its result, which is
+// immutable. Passing 0 for |maxEntries| makes the function uncacheable again.
++ (void)setResultCacheForFunction:(NSString *)functionName onObjectName:(NSString *)objectName maxEntries:(NSUInteger)maxEntries ttl:(NSTimeInterval)ttl;
+
 + (void)enableObjectProxyForClassName:(NSString *)className;
 
++ (void)setAsyncProxyInvocationQueue:(dispatch_queue_t)queue;
+
 #ifdef __cplusplus
 + (void)injectNodeModule:(moduleInit)moduleInitializer name:(NSString *)name;
 
@@ -43,5 +79,22 @@ typedef void (*moduleInit)(v8::Handle<v8::Object> target);
 
 + (BOOL)isNodeActive;
 
+// Record bridge activity (queue traffic, conversions, proxy calls, GC) for
+// export as Chrome trace-event JSON
++ (void)startTracing;
+
++ (void)stopTracing;
+
++ (BOOL)writeTraceToFile:(NSString *)path;
+
+// Live bridge objects and pinned V8 handles, as
+// {name: {count: n, bytes: estimate}}. Proxies are also counted per class of
+// the represented object, named "NodeObjectProxy(ClassName)".
++ (NSDictionary *)memoryCensus;
+
+// Entries which changed between two census snapshots, as
+// {name: {count: delta, bytes: delta}}
++ (NSDictionary *)memoryCensusDiffFrom:(NSDictionary *)from to:(NSDictionary *)to;
+
 
 @end
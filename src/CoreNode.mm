@@ -11,6 +11,9 @@
 #import "core_node.h"
 #import "node_ns_additions.h"
 #import "NodeObjectProxy.h"
+#import "node_trace.h"
+#import "node_census.h"
+#import "node_result_cache.h"
 #import <v8.h>
 #import <node.h>
 
@@ -22,6 +25,13 @@
   return nodeThread;
 }
 
++ (int)runNodeOnMainThreadWithBootstrapPath:(NSString *)bootstrapPath nodePath:(NSString *)nodePath hostMain:(NodeHostMainBlock)hostMain {
+  NodeThread *nodeThread = [[NodeThread alloc] initWithBootstrapPath:bootstrapPath nodePath:nodePath];
+  int status = [nodeThread runOnMainThreadWithHostMain:hostMain];
+  [nodeThread release];
+  return status;
+}
+
 + (void)emitEvent:(NSString *)eventName onObjectName:(NSString *)objectName arguments:(id)argument, ... {
   static const int argcmax = 16;
   id argv[argcmax];
@@ -38,10 +48,40 @@
   nodeEmitEventv([eventName UTF8String], [objectName UTF8String], argc, argv);
 }
 
++ (NodeEventChannel *)eventChannel:(NSString *)eventName onObjectName:(NSString *)objectName {
+  return [[[NodeEventChannel alloc] initWithEventName:eventName objectName:objectName] autorelease];
+}
+
++ (NodeRingChannel *)ringChannel:(NSString *)name capacity:(NSUInteger)capacity {
+  return [[[NodeRingChannel alloc] initWithName:name capacity:capacity] autorelease];
+}
+
 + (void)invokeFunction:(NSString *)functionName onObjectName:(NSString *)objectName arguments:(NSArray *)arguments callback:(NodeCallbackBlock)callbackBlock {
+  if (KNodeResultCacheInvoke(objectName, functionName, arguments, callbackBlock))
+    return;
   nodeInvokeFunction([functionName UTF8String], [objectName UTF8String], arguments, callbackBlock);
 }
 
++ (NodeCancellationToken *)invokeFunction:(NSString *)functionName onObjectName:(NSString *)objectName arguments:(NSArray *)arguments deadline:(NSDate *)deadline callback:(NodeCallbackBlock)callbackBlock {
+  NodeCancellationToken *token = [[[NodeCancellationToken alloc] init] autorelease];
+  CFAbsoluteTime deadlineTime = deadline ? [deadline timeIntervalSinceReferenceDate] : 0;
+  nodeInvokeFunction([functionName UTF8String], [objectName UTF8String], arguments,
+                     deadlineTime, token, callbackBlock);
+  return token;
+}
+
++ (void)setResultCacheForFunction:(NSString *)functionName onObjectName:(NSString *)objectName maxEntries:(NSUInteger)maxEntries ttl:(NSTimeInterval)ttl {
+  KNodeResultCacheSetCacheable(objectName, functionName, maxEntries, ttl);
+}
+
++ (NSDictionary *)shedInvocationCounts {
+  int64_t timedOut, cancelled;
+  NodeGetShedInvocationCounts(&timedOut, &cancelled);
+  return [NSDictionary dictionaryWithObjectsAndKeys:
+          [NSNumber numberWithLongLong:timedOut], @"timedOut",
+          [NSNumber numberWithLongLong:cancelled], @"cancelled", nil];
+}
+
 + (void)injectNodeModule:(moduleInit)moduleInitializer name:(NSString *)name {
   injectNodeModule(moduleInitializer, [name UTF8String], false);
 }
@@ -50,6 +90,10 @@
   initializeObjectProxy([className UTF8String], NULL);
 }
 
++ (void)setAsyncProxyInvocationQueue:(dispatch_queue_t)queue {
+  NodeObjectProxy::SetAsyncInvocationQueue(queue);
+}
+
 + (id)representedObjectForObjectProxy:(v8::Local<v8::Value>)objectProxy {
   return NodeObjectProxy::RepresentedObjectForObjectProxy(objectProxy);
 }
@@ -66,5 +110,25 @@
   return CoreNodeActive;
 }
 
++ (void)startTracing {
+  KNodeTraceStart();
+}
+
++ (void)stopTracing {
+  KNodeTraceStop();
+}
+
++ (BOOL)writeTraceToFile:(NSString *)path {
+  return KNodeTraceWriteToFile(path);
+}
+
++ (NSDictionary *)memoryCensus {
+  return KNodeCensusSnapshot();
+}
+
++ (NSDictionary *)memoryCensusDiffFrom:(NSDictionary *)from to:(NSDictionary *)to {
+  return KNodeCensusDiff(from, to);
+}
+
 
 @end
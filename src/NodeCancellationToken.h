@@ -0,0 +1,26 @@
+//
+//  NodeCancellationToken.h
+//  CoreNode
+//
+//  Copyright 2011 Neat.io Pty Ltd. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+// Returned by invocations into node. Cancelling an invocation which has not
+// yet started in node causes it to be skipped, and its callback to be called
+// with a KNodeErrorInvocationCancelled error. An invocation which is already
+// running in node is not affected.
+@interface NodeCancellationToken : NSObject {
+	@private
+		volatile int32_t cancelled_;
+}
+
+@property (nonatomic, readonly, getter=isCancelled) BOOL cancelled;
+
+// Safe to call from any thread
+- (void)cancel;
+
+
+@end
@@ -0,0 +1,25 @@
+//
+//  NodeCancellationToken.mm
+//  CoreNode
+//
+//  Copyright 2011 Neat.io Pty Ltd. All rights reserved.
+//
+
+#import "NodeCancellationToken.h"
+#import "common.h"
+
+
+@implementation NodeCancellationToken
+
+
+- (void)cancel {
+  h_atomic_cas(&cancelled_, 0, 1);
+}
+
+- (BOOL)isCancelled {
+  h_atomic_barrier();
+  return cancelled_ != 0;
+}
+
+
+@end
@@ -0,0 +1,39 @@
+//
+//  NodeEventChannel.h
+//  CoreNode
+//
+//  Copyright 2011 Neat.io Pty Ltd. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#ifdef __cplusplus
+class KNodeEventChannel;
+#endif
+
+
+// A handle for repeatedly emitting the same event on the same registered
+// object. The target, its emit function and the event name are resolved once
+// in node and cached until the object is re-registered.
+@interface NodeEventChannel : NSObject {
+	@private
+#ifdef __cplusplus
+		KNodeEventChannel *channel_;
+#else
+		void *channel_;
+#endif
+		NSString *eventName_;
+		NSString *objectName_;
+}
+
+@property (nonatomic, readonly) NSString *eventName;
+@property (nonatomic, readonly) NSString *objectName;
+
+- (id)initWithEventName:(NSString *)eventName objectName:(NSString *)objectName;
+
+- (void)emitWithArguments:(id)argument, ... NS_REQUIRES_NIL_TERMINATION;
+
+- (void)emitWithArgumentsArray:(NSArray *)arguments;
+
+
+@end
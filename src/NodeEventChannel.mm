@@ -0,0 +1,70 @@
+//
+//  NodeEventChannel.mm
+//  CoreNode
+//
+//  Copyright 2011 Neat.io Pty Ltd. All rights reserved.
+//
+
+#import "NodeEventChannel.h"
+#import "node_interface.h"
+#import "common.h"
+
+
+@implementation NodeEventChannel
+
+@synthesize eventName = eventName_;
+@synthesize objectName = objectName_;
+
+
+- (id)initWithEventName:(NSString *)eventName objectName:(NSString *)objectName {
+  self = [super init];
+  if (self) {
+    eventName_ = [eventName copy];
+    objectName_ = [objectName copy];
+    channel_ = new KNodeEventChannel([eventName_ UTF8String], [objectName_ UTF8String]);
+  }
+
+  return self;
+}
+
+- (void)dealloc {
+  // the channel holds persistent handles, so it must be deleted in node
+  if (channel_) {
+    NodeEnqueueIOEntry(channel_);
+    channel_ = NULL;
+  }
+  [eventName_ release];
+  [objectName_ release];
+  [super dealloc];
+}
+
+- (void)emitWithArguments:(id)argument, ... {
+  NSMutableArray *arguments = [NSMutableArray array];
+  if (argument) {
+    va_list valist;
+    va_start(valist, argument);
+    for (id arg = argument; arg != nil; arg = va_arg(valist, id)) {
+      [arguments addObject:arg];
+    }
+    va_end(valist);
+  }
+
+  [self emitWithArgumentsArray:arguments];
+}
+
+- (void)emitWithArgumentsArray:(NSArray *)arguments {
+  // the entry copies argv, so large argument lists only need a temporary
+  // heap buffer
+  id stackArgv[KNODE_STACK_ARGC];
+  int argc = (int)[arguments count];
+  id *argv = argc > KNODE_STACK_ARGC ? new id[argc] : stackArgv;
+  [arguments getObjects:argv range:NSMakeRange(0, argc)];
+
+  nodeEmitChannelEventv(channel_, self, argc, argv);
+
+  if (argv != stackArgv)
+    delete [] argv;
+}
+
+
+@end
@@ -10,21 +10,32 @@
 #import "node_interface.h"
 #import "node_ns_additions.h"
 #import "common.h"
+#import "node_census.h"
+
+#include <objc/runtime.h>
+
+// Estimated size of a valueCache_ entry (map node plus persistent handle)
+#define KNODE_VALUE_CACHE_ENTRY_SIZE \
+    (sizeof(std::pair<id, Persistent<Value> >) + 4 * sizeof(void*))
 
 
 @implementation NodeJSFunction
 
 
 - (void)dealloc {
+  if (!function_.IsEmpty())
+    KNodeCensusRemove(KNodeCensusJSFunction, class_getInstanceSize([NodeJSFunction class]));
   function_.Dispose();
   function_.Clear();
 
+  // Note: erasing while iterating invalidates |it|, so dispose first and then
+  // clear the map in one go
   std::map<id, Persistent<Value> >::iterator it;
   for (it = self->valueCache_.begin(); it != self->valueCache_.end(); it++) {
     Persistent<Value> v = it->second;
     v.Dispose();
     v.Clear();
-    self->valueCache_.erase(it->first);
+    KNodeCensusRemove(KNodeCensusJSFunctionValue, KNODE_VALUE_CACHE_ENTRY_SIZE);
   }
   self->valueCache_.clear();
 
@@ -32,6 +43,10 @@
 }
 
 - (void)setV8Function:(v8::Local<v8::Function>)function {
+  if (function_.IsEmpty())
+    KNodeCensusAdd(KNodeCensusJSFunction, class_getInstanceSize([NodeJSFunction class]));
+  else
+    function_.Dispose();
   function_ = Persistent<Function>::New(function);
 }
 
@@ -58,6 +73,7 @@
         argv[argc] = v;
         // Cache for next time
         self->valueCache_[arg] = Persistent<Value>::New(v);
+        KNodeCensusAdd(KNodeCensusJSFunctionValue, KNODE_VALUE_CACHE_ENTRY_SIZE);
       }
       argc++;
     }
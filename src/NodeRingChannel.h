@@ -0,0 +1,60 @@
+//
+//  NodeRingChannel.h
+//  CoreNode
+//
+//  Copyright 2011 Neat.io Pty Ltd. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+#ifdef __cplusplus
+class KNodeRing;
+#endif
+
+
+// A single-producer/single-consumer ring buffer for streaming many small
+// records from Objective-C into node without a queue entry or JS call per
+// record. Records are length-prefixed and written into memory which is shared
+// with JS as a Buffer. Node is only woken up when the ring goes from empty to
+// non-empty, and each wakeup delivers all pending records as one 'data' event
+// carrying an array of Buffer views:
+//
+//   var ring = require('core_node').ringChannel('audio');
+//   ring.on('data', function(records) { ... });
+//
+// The views in |records| point straight into the ring and are only valid for
+// the duration of the 'data' event. Copy them if you need them for longer.
+//
+// Only one thread may write to a channel at any given time.
+@interface NodeRingChannel : NSObject {
+	@private
+#ifdef __cplusplus
+		KNodeRing *ring_;
+#else
+		void *ring_;
+#endif
+		NSString *name_;
+}
+
+@property (nonatomic, readonly) NSString *name;
+
+// Total size of the ring in bytes, including record headers
+@property (nonatomic, readonly) NSUInteger capacity;
+
+// Number of records which have been rejected because the ring was full
+@property (nonatomic, readonly) NSUInteger droppedRecordCount;
+
+- (id)initWithName:(NSString *)name capacity:(NSUInteger)capacity;
+
+// Append a record. Returns NO if there is not enough free space in the ring,
+// in which case the record is dropped.
+- (BOOL)writeBytes:(const void *)bytes length:(NSUInteger)length;
+
+- (BOOL)writeData:(NSData *)data;
+
+// Append a record containing the UTF-8 representation of |string|. Returns
+// NO if |string| is nil.
+- (BOOL)writeString:(NSString *)string;
+
+
+@end
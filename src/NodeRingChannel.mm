@@ -0,0 +1,346 @@
+//
+//  NodeRingChannel.mm
+//  CoreNode
+//
+//  Copyright 2011 Neat.io Pty Ltd. All rights reserved.
+//
+
+#import "NodeRingChannel.h"
+#import "node_interface.h"
+#import "common.h"
+#import <node.h>
+#import <node_buffer.h>
+#import <ev.h>
+#include <map>
+#include <string>
+
+using namespace v8;
+
+// Length prefix telling the reader to continue at the start of the ring
+#define KNODE_RING_WRAP 0xffffffffu
+
+// Records (including their length prefix) are aligned to 4 bytes
+#define KNODE_RING_ALIGN(n) (((n) + 3) & ~((size_t)3))
+
+#define KNODE_RING_MIN_CAPACITY 64
+
+// max number of records delivered per wakeup, so that a busy producer can't
+// starve other watchers on the node loop
+#define KNODE_RING_MAX_DRAIN 1024
+
+
+class KNodeRing {
+ public:
+  KNodeRing(const char *name, size_t capacity);
+  ~KNodeRing();
+
+  // producer side (any thread, but only one at a time)
+  bool write(const void *bytes, size_t length);
+
+  // consumer side (node only)
+  void open();
+  void close();
+  void drain();
+  inline v8::Local<v8::Object> object() { return *object_; }
+
+  size_t capacity_;
+  volatile int32_t dropped_;
+
+ protected:
+  static void Doorbell(EV_P_ ev_async *watcher, int revents);
+  static void FreeData(char *data, void *hint);
+
+  char *name_;
+  char *data_;
+  bool ownsData_;
+  volatile size_t head_;   // next write offset, only modified by the producer
+  volatile size_t tail_;   // next read offset, only modified by the consumer
+  volatile int32_t armed_; // 1 when the consumer is waiting for the doorbell
+  ev_async doorbell_;
+  v8::Persistent<v8::Object> buffer_;  // SlowBuffer covering the whole ring
+  v8::Persistent<v8::Object> object_;
+};
+
+
+// Opens or closes a ring in node
+class KNodeRingIOEntry : public NodeIOEntry {
+ public:
+  KNodeRingIOEntry(KNodeRing *ring, bool close) : ring_(ring), close_(close) {}
+  void perform() {
+    if (close_) ring_->close();
+    else ring_->open();
+    NodeIOEntry::perform();
+  }
+ protected:
+  KNodeRing *ring_;
+  bool close_;
+};
+
+
+// Rings which have been opened in node, keyed by name. Only accessed in node.
+static std::map<std::string, KNodeRing*> KNodeRingMap;
+
+
+// Create a JS Buffer which is a view of |length| bytes at |offset| in
+// |slowBuffer|, without copying anything
+static Local<Value> _NewBufferView(v8::Handle<Object> slowBuffer,
+                                   size_t offset, size_t length) {
+  HandleScope scope;
+  static Persistent<Function> BufferConstructor;
+  if (BufferConstructor.IsEmpty()) {
+    Local<Object> global = Context::GetCurrent()->Global();
+    Local<Value> Buffer_v = global->Get(String::NewSymbol("Buffer"));
+    assert(Buffer_v->IsFunction());
+    BufferConstructor = Persistent<Function>::New(Local<Function>::Cast(Buffer_v));
+  }
+  Local<Value> argv[] = {Local<Value>::New(slowBuffer),
+                         Integer::New((int) length),
+                         Integer::New((int) offset)};
+  return scope.Close(BufferConstructor->NewInstance(3, argv));
+}
+
+
+KNodeRing::KNodeRing(const char *name, size_t capacity) {
+  capacity_ = KNODE_RING_ALIGN(MAX(capacity, KNODE_RING_MIN_CAPACITY));
+  name_ = strdup(name);
+  data_ = new char[capacity_];
+  ownsData_ = true;
+  head_ = tail_ = 0;
+  dropped_ = 0;
+  // disarmed until opened, so that nobody rings an uninitialized doorbell
+  armed_ = 0;
+}
+
+
+KNodeRing::~KNodeRing() {
+  if (ownsData_) delete [] data_;
+  data_ = NULL;
+  free(name_); name_ = NULL;
+}
+
+
+bool KNodeRing::write(const void *bytes, size_t length) {
+  size_t need = KNODE_RING_ALIGN(sizeof(uint32_t) + length);
+  size_t head = head_;
+  h_atomic_barrier();
+  size_t tail = tail_;
+  size_t offset;
+
+  // Records are never split, so when a record does not fit at the end of the
+  // ring we leave a wrap marker and continue at the start. head_ must never
+  // catch up with tail_ since that would make the ring look empty.
+  if (length >= KNODE_RING_WRAP) {
+    offset = capacity_;
+  } else if (head >= tail) {
+    if (capacity_ - head > need || (capacity_ - head == need && tail != 0)) {
+      offset = head;
+    } else if (tail > need) {
+      *(uint32_t*)(data_ + head) = KNODE_RING_WRAP;
+      offset = 0;
+    } else {
+      offset = capacity_;
+    }
+  } else {
+    offset = (tail - head > need) ? head : capacity_;
+  }
+
+  if (offset == capacity_) {
+    h_atomic_inc(&dropped_);
+    return false;
+  }
+
+  *(uint32_t*)(data_ + offset) = (uint32_t) length;
+  memcpy(data_ + offset + sizeof(uint32_t), bytes, length);
+  size_t newHead = offset + need;
+  if (newHead == capacity_) newHead = 0;
+
+  // publish the record, then ring the doorbell if node is waiting for one
+  h_atomic_barrier();
+  head_ = newHead;
+  h_atomic_barrier();
+  if (h_atomic_cas(&armed_, 1, 0))
+    NodeAsyncSend(&doorbell_);
+  return true;
+}
+
+
+void KNodeRing::open() {
+  HandleScope scope;
+  kassert(object_.IsEmpty());
+
+  // from now on the data is owned (and eventually freed) by the buffer
+  node::Buffer *slowBuffer =
+      node::Buffer::New(data_, capacity_, &KNodeRing::FreeData, NULL);
+  buffer_ = Persistent<Object>::New(slowBuffer->handle_);
+  ownsData_ = false;
+
+  Local<Object> object = Object::New();
+  object->Set(String::NewSymbol("name"), String::New(name_));
+  object->Set(String::NewSymbol("capacity"), Integer::New((int) capacity_));
+  object->Set(String::NewSymbol("buffer"), _NewBufferView(buffer_, 0, capacity_));
+  object_ = Persistent<Object>::New(object);
+
+  std::map<std::string, KNodeRing*>::iterator it =
+      KNodeRingMap.find(std::string(name_));
+  if (it != KNodeRingMap.end())
+    WLOG("replacing ring channel '%s'", name_);
+  KNodeRingMap[std::string(name_)] = this;
+
+  doorbell_.data = this;
+  ev_async_init(&doorbell_, &KNodeRing::Doorbell);
+  ev_async_start(EV_DEFAULT_UC_ &doorbell_);
+  // don't keep node alive just because a ring is open
+  ev_unref(EV_DEFAULT_UC);
+
+  // arm the doorbell and pick up anything written before we were opened
+  armed_ = 1;
+  h_atomic_barrier();
+  if (head_ != tail_ && h_atomic_cas(&armed_, 1, 0))
+    NodeAsyncSend(&doorbell_);
+}
+
+
+void KNodeRing::close() {
+  if (!object_.IsEmpty()) {
+    std::map<std::string, KNodeRing*>::iterator it =
+        KNodeRingMap.find(std::string(name_));
+    if (it != KNodeRingMap.end() && it->second == this)
+      KNodeRingMap.erase(it);
+
+    ev_ref(EV_DEFAULT_UC);
+    ev_async_stop(EV_DEFAULT_UC_ &doorbell_);
+
+    object_.Dispose();
+    object_.Clear();
+    buffer_.Dispose();
+    buffer_.Clear();
+  }
+  delete this;
+}
+
+
+// Deliver pending records (at most KNODE_RING_MAX_DRAIN) as a single 'data'
+// event
+void KNodeRing::drain() {
+  HandleScope scope;
+  h_atomic_barrier();
+  size_t head = head_;
+  size_t tail = tail_;
+
+  if (head != tail) {
+    Local<Array> records = Array::New();
+    uint32_t count = 0;
+    while (tail != head && count < KNODE_RING_MAX_DRAIN) {
+      uint32_t length = *(uint32_t*)(data_ + tail);
+      if (length == KNODE_RING_WRAP) {
+        tail = 0;
+        continue;
+      }
+      records->Set(count++, _NewBufferView(buffer_, tail + sizeof(uint32_t), length));
+      tail += KNODE_RING_ALIGN(sizeof(uint32_t) + length);
+      if (tail == capacity_) tail = 0;
+    }
+
+    Local<Value> emitFunction = object_->Get(String::NewSymbol("emit"));
+    if (emitFunction->IsFunction()) {
+      TryCatch tryCatch;
+      Local<Value> argv[] = {Local<Value>::New(String::NewSymbol("data")), records};
+      Local<Function>::Cast(emitFunction)->Call(object_, 2, argv);
+      if (tryCatch.HasCaught())
+        node::FatalException(tryCatch);
+    }
+
+    // hand the space back to the producer
+    h_atomic_barrier();
+    tail_ = tail;
+
+    if (tail != head) {
+      // we hit the limit. Stay disarmed (the producer won't ring) and come
+      // back after other watchers have had their turn.
+      NodeAsyncSend(&doorbell_);
+      return;
+    }
+  }
+
+  // re-arm the doorbell. If something was written while we were busy and the
+  // producer did not see us armed, ring it ourselves.
+  armed_ = 1;
+  h_atomic_barrier();
+  if (head_ != tail_ && h_atomic_cas(&armed_, 1, 0))
+    NodeAsyncSend(&doorbell_);
+}
+
+
+void KNodeRing::Doorbell(EV_P_ ev_async *watcher, int revents) {
+  KNodeRing *ring = static_cast<KNodeRing*>(watcher->data);
+  ring->drain();
+}
+
+
+void KNodeRing::FreeData(char *data, void *hint) {
+  delete [] data;
+}
+
+
+v8::Handle<v8::Value> nodeRingChannelObject(const char *name) {
+  HandleScope scope;
+  std::map<std::string, KNodeRing*>::iterator it =
+      KNodeRingMap.find(std::string(name));
+  if (it == KNodeRingMap.end())
+    return Undefined();
+  return scope.Close(it->second->object());
+}
+
+
+// ----------------------------------------------------------------------------
+
+@implementation NodeRingChannel
+
+@synthesize name = name_;
+
+
+- (id)initWithName:(NSString *)name capacity:(NSUInteger)capacity {
+  self = [super init];
+  if (self) {
+    name_ = [name copy];
+    ring_ = new KNodeRing([name_ UTF8String], capacity);
+    NodeEnqueueIOEntry(new KNodeRingIOEntry(ring_, false));
+  }
+
+  return self;
+}
+
+- (void)dealloc {
+  // closing and deleting the ring is done in node
+  if (ring_) {
+    NodeEnqueueIOEntry(new KNodeRingIOEntry(ring_, true));
+    ring_ = NULL;
+  }
+  [name_ release];
+  [super dealloc];
+}
+
+- (NSUInteger)capacity {
+  return ring_->capacity_;
+}
+
+- (NSUInteger)droppedRecordCount {
+  return (NSUInteger) ring_->dropped_;
+}
+
+- (BOOL)writeBytes:(const void *)bytes length:(NSUInteger)length {
+  return ring_->write(bytes, length);
+}
+
+- (BOOL)writeData:(NSData *)data {
+  return ring_->write([data bytes], [data length]);
+}
+
+- (BOOL)writeString:(NSString *)string {
+  const char *pch = [string UTF8String];
+  if (!pch) return NO;
+  return ring_->write(pch, strlen(pch));
+}
+
+
+@end
@@ -8,6 +8,7 @@
 
 #import <v8.h>
 #include <tr1/memory>
+#import "node_census.h"
 
 namespace kod {
 
@@ -27,6 +28,7 @@ class ExternalUTF16String : public v8::String::ExternalStringResource {
   ExternalUTF16String(uint16_t *data, size_t length)
       : data_(data)
       , length_(length) {
+    if (data_) KNodeCensusAdd(KNodeCensusExternalString, length_ * sizeof(uint16_t));
   }
 
 #ifdef __OBJC__
@@ -35,6 +37,7 @@ class ExternalUTF16String : public v8::String::ExternalStringResource {
     length_ = [src length];
     data_ = new uint16_t[length_];
     [src getCharacters:data_ range:NSMakeRange(0, length_)];
+    KNodeCensusAdd(KNodeCensusExternalString, length_ * sizeof(uint16_t));
   }
 #endif  // __OBJC__
 
@@ -44,6 +47,8 @@ class ExternalUTF16String : public v8::String::ExternalStringResource {
 
   // The string data from the underlying buffer
   void clear(bool freeData=true) {
+    if (data_)
+      KNodeCensusRemove(KNodeCensusExternalString, length_ * sizeof(uint16_t));
     if (data_ && freeData) delete data_;
     data_ = NULL;
     length_ = 0;
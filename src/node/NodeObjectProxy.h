@@ -3,6 +3,7 @@
 // found in the LICENSE file.
 
 #import "core_node.h"
+#import "node_census.h"
 #include <map>
 
 #define KN_OBJC_CLASS_ADDITIONS_BEGIN(name) \
@@ -33,9 +34,18 @@ class NodeObjectProxy : public node::EventEmitter {
                                    id representedObject);
   static v8::Local<v8::Object> New(id representedObject);
 
+  // GCD queue on which the async form of proxied methods (i.e.
+  // obj.foo_bar_async_(a, b, callback)) is invoked. Defaults to the global
+  // default-priority queue when NULL.
+  static void SetAsyncInvocationQueue(dispatch_queue_t queue);
+  static dispatch_queue_t asyncInvocationQueue_;
+
   id representedObject_;
 
  protected:
+  // census counter for the class of the represented object, if any
+  KNodeCensusCounter *censusClassCounter_;
+
 
   typedef std::map<void*, v8::Persistent<v8::FunctionTemplate> >
       PtrToFunctionTemplateMap;
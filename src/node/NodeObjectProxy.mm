@@ -7,6 +7,8 @@
 #import "node_interface.h"
 #import "k_objc_prop.h"
 #import "common.h"
+#import "node_trace.h"
+#import "node_census.h"
 
 #include <objc/runtime.h>
 #include <objc/message.h>
@@ -20,28 +22,56 @@ using namespace node;
 // Unique key for the persistent wrapper associated object
 static char kPersistentWrapperKey = 'a';
 
+// Persistent wrapper associated with an object whose wrapper is persistent.
+// Holds on to the proxy so that the represented object can be detached
+// without touching V8. Enqueued on the release queue when the object is
+// deallocated, and disposed of in node.
+class NodePersistentWrapper : public NodeIOEntry {
+ public:
+  v8::Persistent<v8::Object> handle_;
+  NodeObjectProxy *proxy_;
+  bool targetDeleted_;
+
+  NodePersistentWrapper(v8::Local<v8::Object> obj)
+      : proxy_(ObjectWrap::Unwrap<NodeObjectProxy>(obj))
+      , targetDeleted_(false) {
+    handle_ = Persistent<Object>::New(obj);
+    KNodeCensusAdd(KNodeCensusPersistentWrapper, sizeof(NodePersistentWrapper));
+  }
+
+  virtual ~NodePersistentWrapper() {
+    KNodeCensusRemove(KNodeCensusPersistentWrapper, sizeof(NodePersistentWrapper));
+    if (!handle_.IsEmpty()) {
+      handle_.Dispose();
+      handle_.Clear();
+    }
+  }
+
+  void perform() {
+    HandleScope scope;
+    if (targetDeleted_ && !handle_.IsEmpty()) {
+      Local<Value> v = handle_->Get(String::NewSymbol("onProxyTargetDeleted"));
+      if (v->IsFunction())
+        Local<Function>::Cast(v)->Call(handle_, 0, NULL);
+    }
+    NodeIOEntry::perform();
+  }
+};
+
 @interface _NodeObjectProxyShelf : NSObject {} @end
 @implementation _NodeObjectProxyShelf
 - (void)_NodeObjectProxy_dealloc_associations {
   // clear wrapper
   NSValue *v = objc_getAssociatedObject(self, &kPersistentWrapperKey);
   if (v) {
-    // Since we cannot guarantee which thread this method is invoked on, acquire a lock on V8
-    v8::Locker locker; 
-
-    Persistent<Object> *pobj = (Persistent<Object>*)[v pointerValue];
-    if (!pobj->IsEmpty()) {
-      NodeObjectProxy *p = ObjectWrap::Unwrap<NodeObjectProxy>(*pobj);
-      // clear the represented object, but only if it's self
-      if (h_atomic_cas(&(p->representedObject_), self, nil)) {
-        // queue object for being totally cleared
-        NodeEnqueueIOEntry(
-            new NodeInvocationIOEntry(*pobj, "onProxyTargetDeleted"));
-      }
-      pobj->Dispose();
-      pobj->Clear();
-    }
-    delete pobj;
+    // We cannot guarantee which thread this method is invoked on, so we must
+    // not touch V8 here. Detach ourselves from the proxy and leave the rest to
+    // node.
+    NodePersistentWrapper *wrapper = (NodePersistentWrapper*)[v pointerValue];
+    // clear the represented object, but only if it's self
+    if (h_atomic_cas(&(wrapper->proxy_->representedObject_), self, nil))
+      wrapper->targetDeleted_ = true;
+    NodeEnqueueReleaseEntry(wrapper);
   }
 
   // remove the NSValue
@@ -127,12 +157,20 @@ NodeObjectProxy::PtrToFunctionTemplateMap NodeObjectProxy::constructorMap_;
 
 NodeObjectProxy::NodeObjectProxy(id representedObject) : node::EventEmitter() {
   representedObject_ = representedObject ? [representedObject retain] : NULL;
+  censusClassCounter_ = representedObject ?
+      KNodeCensusCounterForClass([representedObject class]) : NULL;
+  KNodeCensusAdd(KNodeCensusObjectProxy, sizeof(NodeObjectProxy));
+  if (censusClassCounter_)
+    KNodeCensusCounterAdd(censusClassCounter_, sizeof(NodeObjectProxy));
   //fprintf(stderr, "\n------------> allocated NodeObjectProxy %p\n\n", this);
 }
 
 NodeObjectProxy::~NodeObjectProxy() {
   //fprintf(stderr, "\n------------> dealloc NodeObjectProxy %p wrapping %p\n\n",
   //        this, representedObject_);
+  KNodeCensusRemove(KNodeCensusObjectProxy, sizeof(NodeObjectProxy));
+  if (censusClassCounter_)
+    KNodeCensusCounterRemove(censusClassCounter_, sizeof(NodeObjectProxy));
   [representedObject_ release];
 }
 
@@ -142,6 +180,11 @@ v8::Local<Object> NodeObjectProxy::New(v8::Handle<FunctionTemplate> constructor_
   Local<Object> instance = constructor_t->GetFunction()->NewInstance(0, NULL);
   NodeObjectProxy *p = ObjectWrap::Unwrap<NodeObjectProxy>(instance);
   p->representedObject_ = representedObject ? [representedObject retain] : NULL;
+  if (representedObject && !p->censusClassCounter_) {
+    p->censusClassCounter_ =
+        KNodeCensusCounterForClass([representedObject class]);
+    KNodeCensusCounterAdd(p->censusClassCounter_, sizeof(NodeObjectProxy));
+  }
   return scope.Close(instance);
 }
 
@@ -250,9 +293,9 @@ static BOOL _invokeSetter(NSInvocation *invocation,
 }
 
 
-static BOOL _invokeGetter(NSInvocation *invocation,
-                          Local<Value> &returnValue) {
-  [invocation invoke];
+// Convert the return value of an already invoked |invocation|
+static BOOL _getReturnValue(NSInvocation *invocation,
+                            Local<Value> &returnValue) {
   NSMethodSignature *msig = [invocation methodSignature];
   const char *rtype = [msig methodReturnType];
   assert(rtype != NULL);
@@ -326,6 +369,9 @@ static BOOL _invokeGetter(NSInvocation *invocation,
       else returnValue = *v8::Null();
       break;
     }
+    case _C_VOID:
+      returnValue = *v8::Undefined();
+      break;
     default:
       return NO;
   }
@@ -333,6 +379,113 @@ static BOOL _invokeGetter(NSInvocation *invocation,
 }
 
 
+static BOOL _invokeGetter(NSInvocation *invocation,
+                          Local<Value> &returnValue) {
+  [invocation invoke];
+  return _getReturnValue(invocation, returnValue);
+}
+
+
+// Delivers the result of a proxy invocation which was performed off the node
+// thread to its JS callback
+class NodeObjectProxyAsyncResultIOEntry : public NodeIOEntry {
+ public:
+  NodeObjectProxyAsyncResultIOEntry(NSInvocation *invocation,
+                                    Local<Function> callback) {
+    invocation_ = [invocation retain];
+    callback_ = Persistent<Function>::New(callback);
+    returnObject_ = nil;
+    returnCString_ = NULL;
+    exceptionReason_ = nil;
+    failed_ = false;
+  }
+
+  virtual ~NodeObjectProxyAsyncResultIOEntry() {
+    [invocation_ release];
+    [returnObject_ release];
+    if (returnCString_) free(returnCString_);
+    [exceptionReason_ release];
+    callback_.Dispose();
+    callback_.Clear();
+  }
+
+  // called on the invocation queue
+  void invoke() {
+    ARPoolScope poolScope;
+    KNODE_TRACE_SCOPE("proxy", "invoke.async");
+    @try {
+      [invocation_ invoke];
+      // keep the returned object alive until it has been converted in node.
+      // C strings often point into autoreleased objects, so copy them before
+      // the pool is drained.
+      char returnType = [[invocation_ methodSignature] methodReturnType][0];
+      if (returnType == _C_ID) {
+        [invocation_ getReturnValue:&returnObject_];
+        [returnObject_ retain];
+      } else if (returnType == _C_CHARPTR) {
+        char *rv = NULL;
+        [invocation_ getReturnValue:&rv];
+        if (rv) returnCString_ = strdup(rv);
+      }
+    } @catch (NSException *exception) {
+      failed_ = true;
+      // the reason is optional, the name is not
+      NSString *reason = [exception reason];
+      exceptionReason_ = [(reason ? reason : [exception name]) copy];
+    }
+    NodeEnqueueIOEntry(this);
+  }
+
+  void perform() {
+    HandleScope scope;
+    ARPoolScope poolScope;
+    Local<Value> argv[2];
+    if (failed_) {
+      argv[0] = Exception::Error(String::New(
+          exceptionReason_ ? [exceptionReason_ UTF8String] : "exception"));
+      argv[1] = *v8::Undefined();
+    } else {
+      argv[0] = *v8::Null();
+      if ([[invocation_ methodSignature] methodReturnType][0] == _C_CHARPTR) {
+        // the invocation's own return value might be dangling by now
+        if (returnCString_) argv[1] = String::New(returnCString_);
+        else argv[1] = *v8::Null();
+      } else if (!_getReturnValue(invocation_, argv[1])) {
+        argv[1] = *v8::Undefined();
+      }
+    }
+    TryCatch tryCatch;
+    callback_->Call(Context::GetCurrent()->Global(), 2, argv);
+    if (tryCatch.HasCaught())
+      node::FatalException(tryCatch);
+    NodeIOEntry::perform();
+  }
+
+ protected:
+  NSInvocation *invocation_;
+  id returnObject_;
+  char *returnCString_;
+  NSString *exceptionReason_;
+  bool failed_;  // the invocation raised
+  Persistent<Function> callback_;
+};
+
+
+// Only accessed in node
+dispatch_queue_t NodeObjectProxy::asyncInvocationQueue_ = NULL;
+
+void NodeObjectProxy::SetAsyncInvocationQueue(dispatch_queue_t queue) {
+  // The queue is swapped in node, so that the node thread never sees a queue
+  // being released while it's dispatching to it
+  if (queue) dispatch_retain(queue);
+  NodePerformInNode(^(NodeReturnBlock returnCallback) {
+    dispatch_queue_t previous = asyncInvocationQueue_;
+    asyncInvocationQueue_ = queue;
+    if (previous) dispatch_release(previous);
+  });
+}
+
+
 class NodeObjectProxyInvocation {
   public:
     NSInvocation *invocation_;
@@ -347,6 +500,7 @@ class NodeObjectProxyInvocation {
     static Handle<Value> invocationCallback(const Arguments& args) {
       HandleScope scope;
       ARPoolScope poolScope;
+      KNODE_TRACE_SCOPE("proxy", "invoke");
       NodeObjectProxyInvocation *nodeInvocation = static_cast<NodeObjectProxyInvocation *>(External::Unwrap(args.Data()));
       NSInvocation *invocation = nodeInvocation->invocation_;
 
@@ -365,13 +519,77 @@ class NodeObjectProxyInvocation {
       delete nodeInvocation;
       return scope.Close(returnValue);
   }
+
+    // Same as invocationCallback, but the last argument is a callback and the
+    // invocation is performed on the async invocation queue. The callback
+    // receives (error, returnValue) in node once the invocation is done.
+    static Handle<Value> asyncInvocationCallback(const Arguments& args) {
+      HandleScope scope;
+      ARPoolScope poolScope;
+      NodeObjectProxyInvocation *nodeInvocation = static_cast<NodeObjectProxyInvocation *>(External::Unwrap(args.Data()));
+      NSInvocation *invocation = [[nodeInvocation->invocation_ retain] autorelease];
+      delete nodeInvocation;
+
+      int argc = args.Length() - 1;
+      if (argc < 0 || !args[argc]->IsFunction()) {
+        return ThrowException(Exception::TypeError(
+            String::New("last argument must be a callback function")));
+      }
+      if (argc != (int)[[invocation methodSignature] numberOfArguments] - 2) {
+        return ThrowException(Exception::Error(
+            String::New("wrong number of arguments")));
+      }
+
+      // Set arguments (converted here since this requires V8)
+      for (int i=0; i<argc; ++i) {
+        id object = [NSObject fromV8Value:args[i]];
+        if (object == [NSNull null]) object = nil;
+        [invocation setArgument:&object atIndex:2+i];
+      }
+      [invocation retainArguments];
+
+      NodeObjectProxyAsyncResultIOEntry *entry =
+          new NodeObjectProxyAsyncResultIOEntry(invocation,
+                                                Local<Function>::Cast(args[argc]));
+      dispatch_queue_t queue = NodeObjectProxy::asyncInvocationQueue_;
+      if (!queue)
+        queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+      dispatch_async(queue, ^{ entry->invoke(); });
+
+      return Undefined();
+  }
 };
 
 
+// Suffix of the JS name of the async form of a proxied method
+static NSString * const kAsyncMethodSuffix = @"async_";
+
+// Find the invocation for the async form of a method, e.g. "foo_bar_async_"
+// for -foo:bar: or "foo_async_" for -foo. If an object implements both -foo:
+// and -foo, "foo_async_" resolves to -foo: like "foo_" does for the sync form,
+// so the async form of -foo is only available when there is no -foo:.
+static NSInvocation *_findAsyncInvocation(NodeObjectProxy *p, NSString *name) {
+  if (![name hasSuffix:kAsyncMethodSuffix] ||
+      [name length] <= [kAsyncMethodSuffix length] + 1) {
+    return nil;
+  }
+  NSString *baseName =
+      [name substringToIndex:[name length] - [kAsyncMethodSuffix length]];
+  NSInvocation *invocation = _findInvocation(p, baseName, YES);
+  if (!invocation) {
+    // methods without arguments: "foo_" --> "foo"
+    baseName = [baseName substringToIndex:[baseName length] - 1];
+    invocation = _findInvocation(p, baseName, YES);
+  }
+  return invocation;
+}
+
+
 static v8::Handle<Value> NamedGetter(Local<String> property,
                                      const AccessorInfo& info) {
   HandleScope scope;
   ARPoolScope poolScope;
+  KNODE_TRACE_SCOPE("proxy", "get");
 
   // Seems as this isn't needed...
   /*Local<Value> jsval = info.This()->GetRealNamedProperty(property);
@@ -414,6 +632,12 @@ static v8::Handle<Value> NamedGetter(Local<String> property,
       functionTemplate->SetCallHandler(nodeInvocation->invocationCallback, External::New(nodeInvocation));
       Local<Function> function = functionTemplate->GetFunction();
       returnValue = function;
+    } else if ((invocation = _findAsyncInvocation(p, selectorName))) {
+      // Async form of a method call
+      NodeObjectProxyInvocation *nodeInvocation = new NodeObjectProxyInvocation(invocation);
+      Local<FunctionTemplate> functionTemplate = FunctionTemplate::New();
+      functionTemplate->SetCallHandler(nodeInvocation->asyncInvocationCallback, External::New(nodeInvocation));
+      returnValue = functionTemplate->GetFunction();
     }
   }
 
@@ -427,6 +651,7 @@ static v8::Handle<Value> NamedSetter(Local<String> property,
                                      const AccessorInfo& info) {
   HandleScope scope;
   ARPoolScope poolScope;
+  KNODE_TRACE_SCOPE("proxy", "set");
   Local<Value> r;
 
   NodeObjectProxy *p = ObjectWrap::Unwrap<NodeObjectProxy>(info.This());
@@ -649,8 +874,8 @@ KN_OBJC_CLASS_ADDITIONS_BEGIN(NSObject)
     if (!v) {
       Local<Object> obj = NodeObjectProxy::New(self);
       if (!obj.IsEmpty() && obj->IsObject()) {
-        Persistent<Object> *pobj = NodePersistentObjectUnwrap(obj);
-        v = [NSValue valueWithPointer:pobj];
+        NodePersistentWrapper *wrapper = new NodePersistentWrapper(obj);
+        v = [NSValue valueWithPointer:wrapper];
         objc_setAssociatedObject(self, &kPersistentWrapperKey, v,
                                  OBJC_ASSOCIATION_RETAIN);
         [self autorelease]; // to avoid referencing ourselves
@@ -658,8 +883,8 @@ KN_OBJC_CLASS_ADDITIONS_BEGIN(NSObject)
       return scope.Close(obj);
     } else {
       //DLOG("return cached persistent");
-      Persistent<Object> *pobj = (Persistent<Object>*)[v pointerValue];
-      return scope.Close(*pobj);
+      NodePersistentWrapper *wrapper = (NodePersistentWrapper*)[v pointerValue];
+      return scope.Close(wrapper->handle_);
     }
   } else {
     Local<Value> instance = NodeObjectProxy::New(self);
@@ -4,6 +4,7 @@
 
 
 typedef void(^NodeModuleInitializeBlock)(void);
+typedef int(^NodeHostMainBlock)(void);
 extern NSString *const NodeThreadDidFinishExiting;
 extern NSString *const NodeThreadDidCatchUnhandledException;
 
@@ -19,4 +20,15 @@ extern NSString *const NodeThreadDidCatchUnhandledException;
 + (void)handleUncaughtException:(id)err;
 - (void)setEnvironment:(NSDictionary *)environment;
 
+// Run node on the calling (main) thread instead of starting the receiver as a
+// separate thread. Once node has loaded the bootstrap file, |hostMain| (e.g.
+// a block calling NSApplicationMain) is invoked from within node and node is
+// driven by the main run loop from then on, so bridged calls to and from node
+// do not cross threads. Returns the value returned by |hostMain|.
+- (int)runOnMainThreadWithHostMain:(NodeHostMainBlock)hostMain;
+
+// Max latency for node timers and I/O when running on the main thread.
+// Defaults to 0.01 seconds.
++ (void)setMainRunLoopPollInterval:(NSTimeInterval)interval;
+
 @end
@@ -13,6 +13,10 @@ using namespace v8;
 
 static ev_prepare gPrepareNodeWatcher;
 static NodeModuleInitializeBlock ModuleInitializer;
+static ev_idle gHostMainWatcher;
+static NodeHostMainBlock HostMain = nil;
+static int HostMainStatus = 0;
+static NSTimeInterval MainRunLoopPollInterval = 0.01;
 NSString *const NodeThreadDidFinishExiting = @"NodeThreadDidFinishExiting";
 NSString *const NodeThreadDidCatchUnhandledException = @"NodeThreadDidCatchUnhandledException";
 
@@ -35,12 +39,31 @@ static void _KPrepareNode(EV_P_ ev_prepare *watcher, int revents) {
   }
 
   ev_prepare_stop(&gPrepareNodeWatcher);
+
+  // Hand over the main thread to the host once the bootstrap file has run
+  if (HostMain)
+    ev_idle_start(EV_DEFAULT_UC_ &gHostMainWatcher);
+}
+
+
+static void _KRunHostMain(EV_P_ ev_idle *watcher, int revents) {
+  kassert(watcher == &gHostMainWatcher);
+  ev_idle_stop(EV_A_ watcher);
+
+  // From here on node is driven by the main run loop (nested inside the
+  // current ev_run) until the host main function returns.
+  NodeAttachToMainRunLoop(MainRunLoopPollInterval);
+  HostMainStatus = HostMain();
+  NodeDetachFromMainRunLoop();
+  [HostMain release];
+  HostMain = nil;
 }
 
 
 @interface NodeThread()
   @property (nonatomic, copy) NSString *bootstrapPath;
   @property (nonatomic, copy) NSString *nodePath;
+- (void)_runNode;
 @end
 
 @implementation NodeThread
@@ -77,9 +100,51 @@ static void _KPrepareNode(EV_P_ ev_prepare *watcher, int revents) {
   }
 }
 
++ (void)setMainRunLoopPollInterval:(NSTimeInterval)interval {
+  MainRunLoopPollInterval = interval;
+}
+
 - (void)main {
   NSAutoreleasePool *pool = [NSAutoreleasePool new];
 
+  // name the thread so it can be identified in traces
+  [[NSThread currentThread] setName:@"node"];
+
+  [self _runNode];
+
+  [pool drain];
+
+  dispatch_async(dispatch_get_main_queue(), ^{
+    [[NSNotificationCenter defaultCenter] postNotificationName:NodeThreadDidFinishExiting object:self];
+  });
+}
+
+
+- (int)runOnMainThreadWithHostMain:(NodeHostMainBlock)hostMain {
+  kassert([NSThread isMainThread]);
+  kassert(HostMain == nil);
+  NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+  HostMain = [hostMain copy];
+  ev_idle_init(&gHostMainWatcher, _KRunHostMain);
+
+  [self _runNode];
+
+  // node exited before the host got to run
+  if (HostMain) {
+    [HostMain release];
+    HostMain = nil;
+  }
+
+  [pool drain];
+
+  // the main run loop might not be running anymore, so post directly
+  [[NSNotificationCenter defaultCenter] postNotificationName:NodeThreadDidFinishExiting object:self];
+  return HostMainStatus;
+}
+
+
+- (void)_runNode {
   // args
   const char *argv[] = {NULL,"","",NULL};
   argv[0] = [[onconf_bundle() executablePath] UTF8String];
@@ -128,12 +193,6 @@ static void _KPrepareNode(EV_P_ ev_prepare *watcher, int revents) {
   }
 
   unregisterAllNodeObjects();
-
-  [pool drain];
-
-  dispatch_async(dispatch_get_main_queue(), ^{
-    [[NSNotificationCenter defaultCenter] postNotificationName:NodeThreadDidFinishExiting object:self];
-  });
 }
 
 
@@ -7,6 +7,8 @@
 #import "node_interface.h"
 #import "node_ns_additions.h"
 #import "NodeThread.h"
+#import "node_trace.h"
+#import "node_census.h"
 
 NSString *const NodeDidFinishLaunchingNotification = @"NodeDidFinishLaunchingNotification";
 BOOL CoreNodeActive = NO;
@@ -54,6 +56,58 @@ static v8::Handle<Value> UnregisterObjectName(const Arguments& args) {
   return Undefined();
 }
 
+// Returns the ring channel object for a name, or undefined
+static v8::Handle<Value> RingChannel(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length()) {
+    String::Utf8Value utf8pch(args[0]->ToString());
+    return scope.Close(nodeRingChannelObject(*utf8pch));
+  }
+  return Undefined();
+}
+
+static v8::Handle<Value> StartTracing(const Arguments& args) {
+  KNodeTraceStart();
+  return Undefined();
+}
+
+static v8::Handle<Value> StopTracing(const Arguments& args) {
+  KNodeTraceStop();
+  return Undefined();
+}
+
+// Write recorded trace events to the path given as the first argument
+static v8::Handle<Value> WriteTrace(const Arguments& args) {
+  HandleScope scope;
+  if (!args.Length()) return *v8::False();
+  ARPoolScope poolScope;
+  String::Utf8Value utf8pch(args[0]->ToString());
+  BOOL ok = KNodeTraceWriteToFile([NSString stringWithUTF8String:*utf8pch]);
+  return scope.Close(v8::Boolean::New(ok));
+}
+
+// Returns a census of live bridge objects
+static v8::Handle<Value> Census(const Arguments& args) {
+  HandleScope scope;
+  ARPoolScope poolScope;
+  return scope.Close([KNodeCensusSnapshot() v8Value]);
+}
+
+// Returns the difference between two censuses (from, to)
+static v8::Handle<Value> CensusDiff(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() < 2) return Undefined();
+  ARPoolScope poolScope;
+  NSDictionary *from = [NSObject fromV8Value:args[0]];
+  NSDictionary *to = [NSObject fromV8Value:args[1]];
+  if (![from isKindOfClass:[NSDictionary class]] ||
+      ![to isKindOfClass:[NSDictionary class]]) {
+    return ThrowException(Exception::TypeError(
+        String::New("arguments must be census objects")));
+  }
+  return scope.Close([KNodeCensusDiff(from, to) v8Value]);
+}
+
 static v8::Handle<Value> NotifyNodeActive(const Arguments& args) {
   dispatch_async(dispatch_get_main_queue(), ^{
     [[NSNotificationCenter defaultCenter] postNotificationName:NodeDidFinishLaunchingNotification object:nil];
@@ -73,5 +127,11 @@ void core_node_init(v8::Handle<v8::Object> target) {
   NODE_SET_METHOD(target, "handleUncaughtException", HandleUncaughtException);
   NODE_SET_METHOD(target, "registerObject", RegisterObject);
   NODE_SET_METHOD(target, "unregisterObjectName", UnregisterObjectName);
+  NODE_SET_METHOD(target, "_ringChannel", RingChannel);
+  NODE_SET_METHOD(target, "startTracing", StartTracing);
+  NODE_SET_METHOD(target, "stopTracing", StopTracing);
+  NODE_SET_METHOD(target, "writeTrace", WriteTrace);
+  NODE_SET_METHOD(target, "census", Census);
+  NODE_SET_METHOD(target, "censusDiff", CensusDiff);
   NODE_SET_METHOD(target, "_notifyNodeActive", NotifyNodeActive);
 }
@@ -16,6 +16,17 @@ coreNode.inheritNativeModule = function(moduleName, target) {
   target.prototype = _bindingObject;
 };
 
+// Returns the ring channel opened from Objective-C under |name|, or undefined.
+// Records are delivered in batches as 'data' events.
+coreNode.ringChannel = function(name) {
+  var ring = coreNode._ringChannel(name);
+  if (ring && !(ring instanceof events.EventEmitter)) {
+    ring.__proto__ = events.EventEmitter.prototype;
+    events.EventEmitter.call(ring);
+  }
+  return ring;
+};
+
 // Install last line of defence for exceptions to avoid Node killing the app
 process.removeListener('uncaughtException', global._core_node.handleUncaughtException);
 process.on('uncaughtException', global._core_node.handleUncaughtException);
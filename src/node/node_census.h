@@ -0,0 +1,74 @@
+// Copyright (c) 2010-2011, Rasmus Andersson. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#ifndef KNODE_CENSUS_H_
+#define KNODE_CENSUS_H_
+
+#import <Foundation/Foundation.h>
+#include <stdint.h>
+#import "hcommon.h"
+
+/*!
+ * Live memory census of bridge objects.
+ *
+ * Each kind of bridge object which pins V8 handles or external memory keeps
+ * a count of live instances and an estimate of the bytes they hold. Counters
+ * are updated atomically from whichever thread creates or destroys an
+ * object, and can be read from any thread.
+ */
+
+enum KNodeCensusType {
+  KNodeCensusObjectProxy = 0,    // NodeObjectProxy (also counted per class)
+  KNodeCensusBlockFun,           // NodeBlockFun
+  KNodeCensusDictionaryProxy,    // MutableDictionaryProxy
+  KNodeCensusJSFunction,         // NodeJSFunction
+  KNodeCensusJSFunctionValue,    // NodeJSFunction valueCache_ entries
+  KNodeCensusObjectMapEntry,     // registered node objects
+  KNodeCensusExternalString,     // ExternalUTF16String buffers
+  KNodeCensusExternalNSString,   // no-copy external strings retaining NSStrings
+  KNodeCensusPersistentWrapper,  // NodePersistentWrapper
+  KNodeCensusTypeCount
+};
+
+struct KNodeCensusCounter {
+  volatile int64_t count;
+  volatile int64_t bytes;
+};
+
+extern KNodeCensusCounter KNodeCensusCounters[KNodeCensusTypeCount];
+
+static inline void KNodeCensusCounterAdd(KNodeCensusCounter *counter,
+                                         int64_t bytes) {
+  h_atomic_inc(&counter->count);
+  h_atomic_add(&counter->bytes, bytes);
+}
+
+static inline void KNodeCensusCounterRemove(KNodeCensusCounter *counter,
+                                            int64_t bytes) {
+  h_atomic_dec(&counter->count);
+  h_atomic_sub(&counter->bytes, bytes);
+}
+
+static inline void KNodeCensusAdd(KNodeCensusType type, int64_t bytes) {
+  KNodeCensusCounterAdd(&KNodeCensusCounters[type], bytes);
+}
+
+static inline void KNodeCensusRemove(KNodeCensusType type, int64_t bytes) {
+  KNodeCensusCounterRemove(&KNodeCensusCounters[type], bytes);
+}
+
+// Counter for NodeObjectProxy instances representing objects of |cls|. The
+// returned counter lives forever, so callers should hold on to it rather
+// than looking it up again when the object goes away.
+KNodeCensusCounter *KNodeCensusCounterForClass(Class cls);
+
+// Returns a snapshot of all counters as {name: {count: n, bytes: n}}. Proxies
+// per class are named "NodeObjectProxy(ClassName)".
+NSDictionary *KNodeCensusSnapshot();
+
+// Returns the entries which differ between two snapshots as
+// {name: {count: delta, bytes: delta}}
+NSDictionary *KNodeCensusDiff(NSDictionary *from, NSDictionary *to);
+
+#endif  // KNODE_CENSUS_H_
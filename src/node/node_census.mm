@@ -0,0 +1,98 @@
+// Copyright (c) 2010-2011, Rasmus Andersson. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#import "node_census.h"
+#import "common.h"
+
+#include <objc/runtime.h>
+
+KNodeCensusCounter KNodeCensusCounters[KNodeCensusTypeCount];
+
+static const char *KNodeCensusTypeNames[KNodeCensusTypeCount] = {
+  "NodeObjectProxy",
+  "NodeBlockFun",
+  "MutableDictionaryProxy",
+  "NodeJSFunction",
+  "NodeJSFunction.valueCache",
+  "nodeObjectMap",
+  "ExternalUTF16String",
+  "NSString.external",
+  "NodePersistentWrapper",
+};
+
+// Per-class proxy counters. Entries are only ever prepended and never freed,
+// so the list can be walked without locking. Two threads racing to add the
+// same class might both succeed, which is fine since snapshots merge entries
+// by name.
+struct KNodeCensusClassCounter {
+  KNodeCensusCounter counter;
+  Class cls;
+  KNodeCensusClassCounter *next;
+};
+
+static KNodeCensusClassCounter * volatile KNodeCensusClassCounters = NULL;
+
+
+KNodeCensusCounter *KNodeCensusCounterForClass(Class cls) {
+  h_atomic_barrier();
+  for (KNodeCensusClassCounter *c = KNodeCensusClassCounters; c; c = c->next) {
+    if (c->cls == cls) return &c->counter;
+  }
+  KNodeCensusClassCounter *c = new KNodeCensusClassCounter();
+  c->counter.count = 0;
+  c->counter.bytes = 0;
+  c->cls = cls;
+  do {
+    c->next = KNodeCensusClassCounters;
+  } while (!h_casptr(&KNodeCensusClassCounters, c->next, c));
+  return &c->counter;
+}
+
+
+static void _AddEntry(NSMutableDictionary *snapshot, NSString *name,
+                      int64_t count, int64_t bytes) {
+  NSDictionary *prev = [snapshot objectForKey:name];
+  if (prev) {
+    count += [[prev objectForKey:@"count"] longLongValue];
+    bytes += [[prev objectForKey:@"bytes"] longLongValue];
+  }
+  [snapshot setObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                       [NSNumber numberWithLongLong:count], @"count",
+                       [NSNumber numberWithLongLong:bytes], @"bytes", nil]
+               forKey:name];
+}
+
+
+NSDictionary *KNodeCensusSnapshot() {
+  NSMutableDictionary *snapshot = [NSMutableDictionary dictionary];
+  h_atomic_barrier();
+  for (int i = 0; i < KNodeCensusTypeCount; ++i) {
+    _AddEntry(snapshot, [NSString stringWithUTF8String:KNodeCensusTypeNames[i]],
+              KNodeCensusCounters[i].count, KNodeCensusCounters[i].bytes);
+  }
+  for (KNodeCensusClassCounter *c = KNodeCensusClassCounters; c; c = c->next) {
+    NSString *name = [NSString stringWithFormat:@"NodeObjectProxy(%s)",
+                      class_getName(c->cls)];
+    _AddEntry(snapshot, name, c->counter.count, c->counter.bytes);
+  }
+  return snapshot;
+}
+
+
+NSDictionary *KNodeCensusDiff(NSDictionary *from, NSDictionary *to) {
+  NSMutableSet *names = [NSMutableSet setWithArray:[from allKeys]];
+  [names addObjectsFromArray:[to allKeys]];
+  NSMutableDictionary *diff = [NSMutableDictionary dictionary];
+  for (NSString *name in names) {
+    NSDictionary *a = [from objectForKey:name];
+    NSDictionary *b = [to objectForKey:name];
+    int64_t count = [[b objectForKey:@"count"] longLongValue] -
+                    [[a objectForKey:@"count"] longLongValue];
+    int64_t bytes = [[b objectForKey:@"bytes"] longLongValue] -
+                    [[a objectForKey:@"bytes"] longLongValue];
+    if (count != 0 || bytes != 0)
+      _AddEntry(diff, name, count, bytes);
+  }
+  return diff;
+}
@@ -6,12 +6,14 @@
 #import <dispatch/dispatch.h>
 #import <node.h>
 #import "CoreNode.h"
+#import "node_trace.h"
 #include <map>
 #include <vector>
 #include <string>
 
 class NodeIOEntry;
 class NodeBlockFun;
+class KNodeEventChannel;
 namespace kod { class ExternalUTF16String; }
 
 typedef void (^NodeReturnBlock)(NodeCallbackBlock, NSError*, NSArray*);
@@ -21,10 +23,43 @@ typedef void (^NodeFunctionBlock)(const v8::Arguments& args);
 // initialize (must be called from node)
 void NodeInitNode();
 
+// true when node runs on the main thread and is driven by the main run loop
+// rather than running in a thread of its own
+extern bool NodeRunsOnMainRunLoop;
+
+// drive node from the main run loop. Must be called in node, on the main
+// thread. |pollInterval| is the max latency for timers and I/O.
+void NodeAttachToMainRunLoop(CFTimeInterval pollInterval);
+void NodeDetachFromMainRunLoop();
+
 // perform |block| in the node runtime
 void NodePerformInNode(NodePerformBlock block);
+
+// perform |block| in node unless |cancellationToken| has been cancelled or
+// |deadline| (absolute time, 0 for none) has passed by the time it is
+// dequeued, in which case |block| is skipped and |callback| is called with a
+// KNodeErrorInvocationCancelled or KNodeErrorInvocationTimedOut error.
+void NodePerformInNode(NodePerformBlock block, NodeCallbackBlock callback,
+                       CFAbsoluteTime deadline,
+                       NodeCancellationToken *cancellationToken);
+
+// ev_async_send |watcher| and, when node is driven by the main run loop, wake
+// up the run loop so the watcher is not left pending until the next poll.
+// Safe to call from any thread.
+void NodeAsyncSend(ev_async *watcher);
+
+// number of invocations skipped because they timed out or were cancelled
+void NodeGetShedInvocationCounts(int64_t *timedOut, int64_t *cancelled);
 void NodeEnqueueIOEntry(NodeIOEntry *entry);
 
+// enqueue |entry| for release in node. Lock-free and safe to call from any
+// thread. Release entries are performed in batches, in no particular order,
+// before the input queue is drained.
+void NodeEnqueueReleaseEntry(NodeIOEntry *entry);
+
+// max number of arguments passed on the stack rather than on the heap
+#define KNODE_STACK_ARGC 16
+
 /*!
  * Invoke |fun| on |target| passing |argc| number of arguments in |argv|.
  * If |arg0| is set, that value will be used as the first argument and |argc|
@@ -38,6 +73,12 @@ v8::Handle<v8::Value> KNodeCallFunction(v8::Handle<v8::Object> target,
 // invoke a named function inside node
 void nodeInvokeFunction(const char *functionName, const char *objectName, NSArray *args, NodeCallbackBlock callback);
 
+// invoke a named function inside node, unless cancelled or past |deadline|
+// (absolute time, 0 for none) before it starts. See NodePerformInNode
+void nodeInvokeFunction(const char *functionName, const char *objectName, NSArray *args,
+                        CFAbsoluteTime deadline, NodeCancellationToken *cancellationToken,
+                        NodeCallbackBlock callback);
+
 void nodeInvokeFunction(const char *functionName, const char *objectName, NodeCallbackBlock callback);
 
 // emit an event on the specified object, passing args
@@ -46,15 +87,33 @@ void nodeEmitEventv(const char *eventName, const char *objectName, int argc, id
 // emit an event on the specified object, passing nil-terminated list of args
 void nodeEmitEvent(const char *eventName, const char *objectName, ...);
 
+// emit an event through a pre-resolved |channel|. |owner| is retained until
+// the event has been delivered and must keep |channel| alive.
+void nodeEmitChannelEventv(KNodeEventChannel *channel, id owner, int argc, id *argv);
+
 // perform |block| in the CoreNode runtime (queue defaults to main thread)
 static inline void NodePerformInCoreNode(NodeCallbackBlock block,
                                      NSError *err=nil,
                                      NSArray *args=nil,
                                      dispatch_queue_t queue=NULL) {
   if (!queue) queue = dispatch_get_main_queue();
-  dispatch_async(queue, ^{ block(err, args); });
+  if (NodeRunsOnMainRunLoop && pthread_main_np() &&
+      queue == dispatch_get_main_queue()) {
+    // we are already where the callback should be delivered
+    KNODE_TRACE_SCOPE("bridge", "callback");
+    block(err, args);
+    return;
+  }
+  dispatch_async(queue, ^{
+    KNODE_TRACE_SCOPE("bridge", "callback");
+    block(err, args);
+  });
 }
 
+// returns the JS object of the ring channel named |name|, or undefined if no
+// such ring has been opened
+v8::Handle<v8::Value> nodeRingChannelObject(const char *name);
+
 // inject a custom Node module into the global context
 void injectNodeModule(void(*init_module)(v8::Handle<v8::Object> target), const char *module_name, bool root);
 
@@ -84,7 +143,11 @@ class NodeIOEntry {
 // Invocation transaction I/O queue entry
 class KNodeTransactionalIOEntry : public NodeIOEntry {
  public:
-  KNodeTransactionalIOEntry(NodePerformBlock block, dispatch_queue_t returnDispatchQueue=NULL) {
+  KNodeTransactionalIOEntry(NodePerformBlock block,
+                            dispatch_queue_t returnDispatchQueue=NULL,
+                            NodeCallbackBlock callback=nil,
+                            CFAbsoluteTime deadline=0,
+                            NodeCancellationToken *cancellationToken=nil) {
     performBlock_ = [block copy];
     if (returnDispatchQueue) {
       returnDispatchQueue_ = returnDispatchQueue;
@@ -92,6 +155,9 @@ class KNodeTransactionalIOEntry : public NodeIOEntry {
     } else {
       returnDispatchQueue_ = NULL;
     }
+    callback_ = [callback copy];
+    deadline_ = deadline;
+    cancellationToken_ = [cancellationToken retain];
   }
 
   virtual ~KNodeTransactionalIOEntry() {
@@ -100,25 +166,21 @@ class KNodeTransactionalIOEntry : public NodeIOEntry {
       dispatch_release(returnDispatchQueue_);
     }
     returnDispatchQueue_ = NULL;
+    [callback_ release];
+    [cancellationToken_ release];
   }
 
-  void perform() {
-    // maintain a weak reference because the queue may be released
-	__block dispatch_queue_t blockReturnQueue = returnDispatchQueue_;
-    performBlock_(^(NodeCallbackBlock callback, NSError *err, NSArray *args) {
-      if (callback) {
-        // queue may be released by now
-        // invoke the original ObjC callback block that was provided by the caller
-        NodePerformInCoreNode(callback, err, args, blockReturnQueue);
-      }
-    });
-    // call super which will delete this instance
-    NodeIOEntry::perform();
-  }
+  void perform();
 
  protected:
+  // returns an error if this entry should be skipped rather than performed
+  NSError *shedError();
+
   NodePerformBlock performBlock_;
   dispatch_queue_t returnDispatchQueue_;
+  NodeCallbackBlock callback_;
+  CFAbsoluteTime deadline_;
+  NodeCancellationToken *cancellationToken_;
 };
 
 
@@ -151,15 +213,59 @@ class NodeEventIOEntry : public NodeIOEntry {
 };
 
 
+// Event channel. Resolves and caches the target object, its emit function and
+// the interned event name the first time it's used so that subsequent emits
+// skip all name lookups. Rebinds automatically when the object registered
+// under |objectName| changes. Can be created on any thread, but must only be
+// used in node. Dispose of it by enqueueing it with NodeEnqueueIOEntry.
+class KNodeEventChannel : public NodeIOEntry {
+ public:
+  KNodeEventChannel(const char *name, const char *objectName);
+  virtual ~KNodeEventChannel();
+  void emit(int argc, id *argv);
+ protected:
+  bool resolve();
+  void unbind();
+  char *name_;
+  char *objectName_;
+  int generation_;
+  v8::Persistent<v8::Object> target_;
+  v8::Persistent<v8::Function> emit_;
+  v8::Persistent<v8::String> symbol_;
+};
+
+
+// Channel event I/O queue entry
+class KNodeChannelEventIOEntry : public NodeIOEntry {
+ public:
+  KNodeChannelEventIOEntry(KNodeEventChannel *channel, id owner, int argc, id *argv);
+  virtual ~KNodeChannelEventIOEntry();
+  void perform();
+ protected:
+  KNodeEventChannel *channel_;
+  id owner_;
+  int argc_;
+  id *argv_;
+};
+
+
 // -------------------
 
+// A JS function which calls |block| the first time it's invoked. All
+// instances share a single native function and are told apart by a slot in a
+// pooled table, which is released (and the instance deleted) on the first
+// invocation or when the instance is deleted. Instances which are never
+// invoked nor deleted are deleted when the JS function is garbage collected.
 class NodeBlockFun {
   NodeFunctionBlock block_;
   v8::Persistent<v8::Function> fun_;
+  double slotKey_;
  public:
   NodeBlockFun(NodeFunctionBlock block);
   ~NodeBlockFun();
-  inline v8::Local<v8::Value> function() { return *fun_; }
+  inline v8::Local<v8::Value> function() {
+    return v8::Local<v8::Value>::New(fun_);
+  }
   static v8::Handle<v8::Value> InvocationProxy(const v8::Arguments& args);
  protected:
   static void WeakCallback (v8::Persistent<v8::Value> value, void *data);
@@ -173,24 +279,3 @@ class ARPoolScope {
   ARPoolScope() { pool_ = [NSAutoreleasePool new]; }
   ~ARPoolScope() { [pool_ drain]; pool_ = nil; }
 };
-
-// -------------------
-
-static inline v8::Persistent<v8::Object>* NodePersistentObjectUnwrap(
-    const v8::Local<v8::Value> &v) {
-  v8::Persistent<v8::Object> *pobj = new v8::Persistent<v8::Object>();
-  *pobj = v8::Persistent<v8::Object>::New(v8::Local<v8::Object>::Cast(v));
-  return pobj;
-}
-
-static inline v8::Persistent<v8::Object>* NodePersistentObjectUnwrap(void *data) {
-  v8::Persistent<v8::Object> *pobj = reinterpret_cast<v8::Persistent<v8::Object>*>(data);
-  assert((*pobj)->IsObject());
-  return pobj;
-}
-
-static inline void NodePersistentObjectDestroy(v8::Persistent<v8::Object> *pobj) {
-  pobj->Dispose();
-  delete pobj;
-}
-
@@ -5,11 +5,13 @@
 #import "common.h"
 #import "node_interface.h"
 #import "node_ns_additions.h"
+#import "node_census.h"
 #import "ExternalUTF16String.h"
 #import <node.h>
 #import <node_events.h>
 #import <ev.h>
 #import <libkern/OSAtomic.h>
+#import <pthread.h>
 #import "NodeObjectProxy.h"
 
 using namespace v8;
@@ -25,14 +27,36 @@ void DummyFunction() { }
 // queue with entries of type NodeIOEntry*
 static OSQueueHead KNodeIOInputQueue;
 
+// queue with entries of type NodeIOEntry* which release resources on behalf of
+// other threads (e.g. persistent wrappers of deallocated objects)
+static OSQueueHead KNodeIOReleaseQueue;
+
 // ev notifier
 static ev_async KNodeIOInputQueueNotifier;
 
 // Map to hold registered objects
 static std::map<std::string, v8::Persistent<v8::Object> > nodeObjectMap;
 
+// Bumped every time nodeObjectMap changes so that cached lookups (i.e. event
+// channels) know when to rebind. Only accessed in node.
+static int nodeObjectMapGeneration = 0;
+
 static v8::Persistent<v8::Object> coreNodeModule;
 
+bool NodeRunsOnMainRunLoop = false;
+
+// invocations skipped because they were cancelled or timed out
+static volatile int64_t KNodeShedTimedOutCount = 0;
+static volatile int64_t KNodeShedCancelledCount = 0;
+
+// main run loop integration, only used when NodeRunsOnMainRunLoop is set
+static CFRunLoopSourceRef KNodeRunLoopSource = NULL;
+static CFRunLoopObserverRef KNodeRunLoopObserver = NULL;
+static CFRunLoopTimerRef KNodeRunLoopTimer = NULL;
+static int KNodeRunLoopPumpDepth = 0;
+// guards KNodeRunLoopSource, which producers signal from any thread
+static pthread_mutex_t KNodeRunLoopSourceLock = PTHREAD_MUTEX_INITIALIZER;
+
 // max number of entries to dequeue in one flush
 #define KNODE_MAX_DEQUEUE 100
 
@@ -42,6 +66,7 @@ static v8::Persistent<v8::Object> coreNodeModule;
 // Triggered when there are stuff on inputQueue_
 static void _QueueNotification(OSQueueHead *queue, ev_async *watcher, int revents) {
   HandleScope scope;
+  KNodeTraceScope traceScope("queue", "drain");
   //NSLog(@"InputQueueNotification");
 
   // enumerate queue
@@ -49,24 +74,47 @@ static void _QueueNotification(OSQueueHead *queue, ev_async *watcher, int revent
   NodeIOEntry* entries[KNODE_MAX_DEQUEUE+1];
   int i = 0;
   NodeIOEntry* entry;
-  while ( (entry = (NodeIOEntry*)OSAtomicDequeue(
-           queue, cxx_offsetof(NodeIOEntry, next_)))
-          && (i < KNODE_MAX_DEQUEUE) ) {
+  while ( (i < KNODE_MAX_DEQUEUE)
+          && (entry = (NodeIOEntry*)OSAtomicDequeue(
+              queue, cxx_offsetof(NodeIOEntry, next_))) ) {
     //NSLog(@"dequeued NodeIOEntry@%p", entry);
     entries[i++] = entry;
   }
   entries[i] = NULL; // sentinel
 
+  // if we hit the limit there might be more, so make sure we're called again
+  if (i == KNODE_MAX_DEQUEUE)
+    NodeAsyncSend(watcher);
+
+  traceScope.setArg(i);
+
   // perform entries in the order they where queued
   while (i && (entry = entries[--i])) {
+    KNODE_TRACE_SCOPE("queue", "perform");
     entry->perform();
     // Note: |entry| is invalid beyond this point as it probably deleted itself
   }
 }
 
 
-// Triggered when there are stuff on inputQueue_
+// Performs all entries on the release queue in one batch
+static void _DrainReleaseQueue(OSQueueHead *queue) {
+  HandleScope scope;
+  KNodeTraceScope traceScope("queue", "release");
+  NodeIOEntry* entry;
+  int64_t count = 0;
+  while ( (entry = (NodeIOEntry*)OSAtomicDequeue(
+           queue, cxx_offsetof(NodeIOEntry, next_))) ) {
+    entry->perform();
+    ++count;
+  }
+  traceScope.setArg(count);
+}
+
+
+// Triggered when there are stuff on inputQueue_ or the release queue
 static void InputQueueNotification(EV_P_ ev_async *watcher, int revents) {
+  _DrainReleaseQueue(&KNodeIOReleaseQueue);
   _QueueNotification(&KNodeIOInputQueue, watcher, revents);
 }
 
@@ -82,25 +130,103 @@ static void _freePersistentArgs(int argc, Persistent<Value> *argv) {
 }
 
 
+// Slot table for NodeBlockFun. Only accessed in node. A slot key encodes
+// both the slot index and the slot's generation, which is bumped every time
+// the slot is released so that stale JS functions can't reach a new owner.
+#define KNODE_BLOCKFUN_SLOT_LIMIT 1048576.0
+static std::vector<NodeBlockFun*> KNodeBlockFunSlots;
+static std::vector<uint32_t> KNodeBlockFunSlotGenerations;
+static std::vector<uint32_t> KNodeBlockFunFreeSlots;
+
+// Creates a JS function bound to a slot key, calling the shared native
+// function with the slot key as |this|
+static v8::Persistent<v8::Function> KNodeBlockFunBinder;
+
+static double _AcquireBlockFunSlot(NodeBlockFun *blockFun) {
+  uint32_t index;
+  if (!KNodeBlockFunFreeSlots.empty()) {
+    index = KNodeBlockFunFreeSlots.back();
+    KNodeBlockFunFreeSlots.pop_back();
+    KNodeBlockFunSlots[index] = blockFun;
+  } else {
+    index = (uint32_t)KNodeBlockFunSlots.size();
+    kassert(index < KNODE_BLOCKFUN_SLOT_LIMIT);
+    KNodeBlockFunSlots.push_back(blockFun);
+    KNodeBlockFunSlotGenerations.push_back(0);
+  }
+  return (double)KNodeBlockFunSlotGenerations[index] * KNODE_BLOCKFUN_SLOT_LIMIT
+       + (double)index;
+}
+
+// Returns the owner of the slot, or NULL if the slot has been released
+static NodeBlockFun *_LookupBlockFunSlot(double key) {
+  if (!(key >= 0)) return NULL;  // also catches NaN
+  double generation = floor(key / KNODE_BLOCKFUN_SLOT_LIMIT);
+  double index = key - generation * KNODE_BLOCKFUN_SLOT_LIMIT;
+  if (index >= KNodeBlockFunSlots.size() ||
+      (double)KNodeBlockFunSlotGenerations[(size_t)index] != generation) {
+    return NULL;
+  }
+  return KNodeBlockFunSlots[(size_t)index];
+}
+
+static void _ReleaseBlockFunSlot(double key) {
+  NodeBlockFun *blockFun = _LookupBlockFunSlot(key);
+  if (!blockFun) return;
+  uint32_t index = (uint32_t)fmod(key, KNODE_BLOCKFUN_SLOT_LIMIT);
+  KNodeBlockFunSlots[index] = NULL;
+  ++KNodeBlockFunSlotGenerations[index];
+  KNodeBlockFunFreeSlots.push_back(index);
+}
+
+static Local<Function> _BindBlockFunSlot(double key) {
+  HandleScope scope;
+  if (KNodeBlockFunBinder.IsEmpty()) {
+    // compiled once, then every call only creates a cheap closure
+    Local<FunctionTemplate> t =
+        FunctionTemplate::New(&NodeBlockFun::InvocationProxy);
+    Local<Value> factory = Script::Compile(String::New(
+        "(function(invoke) {"
+        "  return function(key) {"
+        "    return function() { return invoke.apply(key, arguments); };"
+        "  };"
+        "})"))->Run();
+    Local<Value> invoke = t->GetFunction();
+    Local<Value> binder = Local<Function>::Cast(factory)->Call(
+        Context::GetCurrent()->Global(), 1, &invoke);
+    KNodeBlockFunBinder =
+        Persistent<Function>::New(Local<Function>::Cast(binder));
+  }
+  Local<Value> keyValue = Number::New(key);
+  Local<Value> fun = KNodeBlockFunBinder->Call(
+      Context::GetCurrent()->Global(), 1, &keyValue);
+  return scope.Close(Local<Function>::Cast(fun));
+}
+
+
 NodeBlockFun::NodeBlockFun(NodeFunctionBlock block) {
   block_ = [block copy];
-  Local<FunctionTemplate> t = FunctionTemplate::New(&NodeBlockFun::InvocationProxy, External::Wrap(this));
-  fun_ = Persistent<Function>::New(t->GetFunction());
+  KNodeCensusAdd(KNodeCensusBlockFun, sizeof(NodeBlockFun));
+  slotKey_ = _AcquireBlockFunSlot(this);
+  fun_ = Persistent<Function>::New(_BindBlockFunSlot(slotKey_));
+  // only reached if the function is never invoked
   fun_.MakeWeak(this, NodeBlockFun::WeakCallback);
 }
 
 void NodeBlockFun::WeakCallback (v8::Persistent<v8::Value> value, void *data) {
   NodeBlockFun *blockFun = static_cast<NodeBlockFun *>(data);
   assert(value.IsNearDeath());
+  // disposes of fun_, which is |value|
   delete blockFun;
-  value.Dispose();
-  value.Clear();
 }
 
 NodeBlockFun::~NodeBlockFun() {
+  KNodeCensusRemove(KNodeCensusBlockFun, sizeof(NodeBlockFun));
+  _ReleaseBlockFunSlot(slotKey_);
   [block_ release];
   block_ = nil;
   if (!fun_.IsEmpty()) {
+    // also cancels the weak callback
     fun_.Dispose();
     fun_.Clear();
   }
@@ -108,17 +234,19 @@ NodeBlockFun::~NodeBlockFun() {
 
 // static
 // this will be invoked when the JS function executes the callback
-// unwrap the arguments that come back to retrieve the original NodeBlockFun instance
+// the receiver is the slot key which identifies the original NodeBlockFun
 v8::Handle<Value> NodeBlockFun::InvocationProxy(const Arguments& args) {
-  Local<Value> data = args.Data();
-  assert(!data.IsEmpty());
-  NodeBlockFun* blockFun = (NodeBlockFun*)External::Unwrap(data);
-  if (blockFun->block_) {
-    assert(((void*)blockFun->block_) != NULL);
-    blockFun->block_(args);
-
-    [blockFun->block_ release];
+  NodeBlockFun *blockFun = _LookupBlockFunSlot(args.This()->NumberValue());
+  if (blockFun) {
+    // release the slot before calling out, so that any re-entrant invocation
+    // of the same function is ignored
+    NodeFunctionBlock block = blockFun->block_;
     blockFun->block_ = nil;
+    delete blockFun;
+    if (block) {
+      block(args);
+      [block release];
+    }
   }
   return Undefined();
 }
@@ -167,8 +295,10 @@ v8::Handle<v8::Value> KNodeCallFunction(v8::Handle<Object> target,
   if (arg0)
     ++argc;
 
-  // allocate list of arguments
-  Local<Value> *argv = new Local<Value>[argc];
+  // allocate list of arguments (on the stack unless there are many of them)
+  Local<Value> stackArgv[KNODE_STACK_ARGC];
+  Local<Value> *argv = (argc <= KNODE_STACK_ARGC) ? stackArgv
+                                                   : new Local<Value>[argc];
 
   // add firstArgAsString
   if (arg0)
@@ -187,17 +317,27 @@ v8::Handle<v8::Value> KNodeCallFunction(v8::Handle<Object> target,
 
   // invoke function
   Local<Value> ret = fun->Call(target, argc, argv);
-  delete argv;
+  if (argv != stackArgv)
+    delete [] argv;
 
   return scope.Close(ret);
 }
 
 
 void nodeInvokeFunction(const char *functionName, const char *objectName, NSArray *args, NodeCallbackBlock callback) {
+  nodeInvokeFunction(functionName, objectName, args, 0, nil, callback);
+}
+
+
+void nodeInvokeFunction(const char *functionName, const char *objectName, NSArray *args,
+                        CFAbsoluteTime deadline, NodeCancellationToken *cancellationToken,
+                        NodeCallbackBlock callback) {
   // call from kod-land
   //DLOG("[knode] 1 calling node from kod");
-  char *function = strdup(functionName);
-  char *object = strdup(objectName);
+  // copied by value into the block since it is released without being called
+  // if the invocation is shed
+  std::string function(functionName);
+  std::string object(objectName);
   NodePerformInNode(^(NodeReturnBlock returnCallback) {
     ARPoolScope outerPool;
     //DLOG("[knode] 1 called in node");
@@ -243,20 +383,18 @@ void nodeInvokeFunction(const char *functionName, const char *objectName, NSArra
         argv[i] = [[args objectAtIndex:i] v8Value];
       }
       argv[i] = fun;
-      didFindAndCallFun = _invokeJSFunction(function, object, (unsigned int) argc, argv);
+      didFindAndCallFun = _invokeJSFunction(function.c_str(), object.c_str(), (unsigned int) argc, argv);
       delete argv;
     } else {
-      didFindAndCallFun = _invokeJSFunction(function, object, 1, &fun);
+      didFindAndCallFun = _invokeJSFunction(function.c_str(), object.c_str(), 1, &fun);
     }
 
     NSError *error = nil;
     if (tryCatch.HasCaught()) {
       error = [NSError nodeErrorWithTryCatch:tryCatch];
     } else if (!didFindAndCallFun) {
-      error = [NSError nodeErrorWithFormat:@"Unknown method '%s'", function];
+      error = [NSError nodeErrorWithFormat:@"Unknown method '%s'", function.c_str()];
     }
-    free(function);
-    free(object);
 
     if (error) {
       DLOG("[knode] error while calling into node: %@", error);
@@ -267,7 +405,7 @@ void nodeInvokeFunction(const char *functionName, const char *objectName, NSArra
         returnCallback(callback, error, nil);
       }
     }
-  });
+  }, callback, deadline, cancellationToken);
 }
 
 
@@ -276,9 +414,21 @@ void nodeInvokeFunction(const char *functionName, const char *objectName, NodeCa
 }
 
 
+// Perform |entry| right away if we are on the node thread and node is driven
+// by the main run loop, otherwise enqueue it
+static void _NodePerformOrEnqueueIOEntry(NodeIOEntry *entry) {
+  if (NodeRunsOnMainRunLoop && pthread_main_np()) {
+    KNODE_TRACE_SCOPE("queue", "perform.inline");
+    entry->perform();
+  } else {
+    NodeEnqueueIOEntry(entry);
+  }
+}
+
+
 void nodeEmitEventv(const char *eventName, const char *objectName, int argc, id *argv) {
   NodeEventIOEntry *entry = new NodeEventIOEntry(eventName, objectName, argc, argv);
-  NodeEnqueueIOEntry(entry);
+  _NodePerformOrEnqueueIOEntry(entry);
 }
 
 
@@ -297,20 +447,47 @@ void nodeEmitEvent(const char *eventName, const char *objectName, ...) {
 }
 
 
+void nodeEmitChannelEventv(KNodeEventChannel *channel, id owner, int argc, id *argv) {
+  _NodePerformOrEnqueueIOEntry(new KNodeChannelEventIOEntry(channel, owner, argc, argv));
+}
+
+
 void NodeInitNode() {
   // setup notifiers
   KNodeIOInputQueueNotifier.data = NULL;
   ev_async_init(&KNodeIOInputQueueNotifier, &InputQueueNotification);
   ev_async_start(EV_DEFAULT_UC_ &KNodeIOInputQueueNotifier);
 
+  // install tracer hooks (only active while tracing)
+  KNodeTraceInitNode();
+
   // stuff might have been queued before we initialized, so trigger a dequeue
-  ev_async_send(EV_DEFAULT_UC_ &KNodeIOInputQueueNotifier);
+  NodeAsyncSend(&KNodeIOInputQueueNotifier);
+}
+
+
+void NodeAsyncSend(ev_async *watcher) {
+  ev_async_send(EV_DEFAULT_UC_ watcher);
+  // callers publish their data with a barrier before this, so if we see the
+  // flag unset here the data will be picked up by NodeAttachToMainRunLoop
+  h_atomic_barrier();
+  if (NodeRunsOnMainRunLoop) {
+    // node does not block in its own loop, so wake up the main run loop. The
+    // lock keeps NodeDetachFromMainRunLoop from freeing the source under us.
+    pthread_mutex_lock(&KNodeRunLoopSourceLock);
+    if (KNodeRunLoopSource) {
+      CFRunLoopSourceSignal(KNodeRunLoopSource);
+      CFRunLoopWakeUp(CFRunLoopGetMain());
+    }
+    pthread_mutex_unlock(&KNodeRunLoopSourceLock);
+  }
 }
 
 
 static void _NodeEnqueueEntry(OSQueueHead *queue, ev_async *asyncWatcher, NodeIOEntry *entry) {
+  KNODE_TRACE_SCOPE("queue", "enqueue");
   OSAtomicEnqueue(queue, entry, cxx_offsetof(NodeIOEntry, next_));
-  ev_async_send(EV_DEFAULT_UC_ asyncWatcher);
+  NodeAsyncSend(asyncWatcher);
 }
 
 
@@ -319,10 +496,163 @@ void NodeEnqueueIOEntry(NodeIOEntry *entry) {
 }
 
 
+void NodeEnqueueReleaseEntry(NodeIOEntry *entry) {
+  _NodeEnqueueEntry(&KNodeIOReleaseQueue, &KNodeIOInputQueueNotifier, entry);
+}
+
+
 void NodePerformInNode(NodePerformBlock block) {
   dispatch_queue_t queue = dispatch_get_current_queue();
   NodeIOEntry *entry = new KNodeTransactionalIOEntry(block, queue);
-  NodeEnqueueIOEntry(entry);
+  _NodePerformOrEnqueueIOEntry(entry);
+}
+
+
+void NodePerformInNode(NodePerformBlock block, NodeCallbackBlock callback,
+                       CFAbsoluteTime deadline,
+                       NodeCancellationToken *cancellationToken) {
+  dispatch_queue_t queue = dispatch_get_current_queue();
+  NodeIOEntry *entry = new KNodeTransactionalIOEntry(block, queue, callback,
+                                                     deadline,
+                                                     cancellationToken);
+  _NodePerformOrEnqueueIOEntry(entry);
+}
+
+
+void NodeGetShedInvocationCounts(int64_t *timedOut, int64_t *cancelled) {
+  h_atomic_barrier();
+  if (timedOut) *timedOut = KNodeShedTimedOutCount;
+  if (cancelled) *cancelled = KNodeShedCancelledCount;
+}
+
+
+NSError *KNodeTransactionalIOEntry::shedError() {
+  if (cancellationToken_ && [cancellationToken_ isCancelled]) {
+    h_atomic_inc(&KNodeShedCancelledCount);
+    return [NSError errorWithDomain:KNodeErrorDomain
+                               code:KNodeErrorInvocationCancelled
+                           userInfo:[NSDictionary dictionaryWithObject:
+                               @"Invocation was cancelled"
+                               forKey:NSLocalizedDescriptionKey]];
+  }
+  if (deadline_ != 0 && CFAbsoluteTimeGetCurrent() > deadline_) {
+    h_atomic_inc(&KNodeShedTimedOutCount);
+    return [NSError errorWithDomain:KNodeErrorDomain
+                               code:KNodeErrorInvocationTimedOut
+                           userInfo:[NSDictionary dictionaryWithObject:
+                               @"Invocation timed out before it started"
+                               forKey:NSLocalizedDescriptionKey]];
+  }
+  return nil;
+}
+
+
+void KNodeTransactionalIOEntry::perform() {
+  // skip stale work before any arguments are converted. The node thread has
+  // no autorelease pool of its own, so the error is drained here.
+  ARPoolScope poolScope;
+  NSError *error = shedError();
+  if (error) {
+    KNODE_TRACE_SCOPE("queue", "shed");
+    if (callback_)
+      NodePerformInCoreNode(callback_, error, nil, returnDispatchQueue_);
+  } else {
+    // maintain a weak reference because the queue may be released
+    __block dispatch_queue_t blockReturnQueue = returnDispatchQueue_;
+    performBlock_(^(NodeCallbackBlock callback, NSError *err, NSArray *args) {
+      if (callback) {
+        // queue may be released by now
+        // invoke the original ObjC callback block that was provided by the caller
+        NodePerformInCoreNode(callback, err, args, blockReturnQueue);
+      }
+    });
+  }
+  // call super which will delete this instance
+  NodeIOEntry::perform();
+}
+
+
+// Run one non-blocking iteration of the node loop
+static void _NodePumpLoop() {
+  // don't re-enter from nested run loops started by node itself
+  if (KNodeRunLoopPumpDepth) return;
+  ++KNodeRunLoopPumpDepth;
+  ev_run(EV_DEFAULT_UC_ EVRUN_NOWAIT);
+  --KNodeRunLoopPumpDepth;
+}
+
+static void _NodeRunLoopSourcePerform(void *info) {
+  _NodePumpLoop();
+}
+
+static void _NodeRunLoopObserverCallback(CFRunLoopObserverRef observer,
+                                         CFRunLoopActivity activity,
+                                         void *info) {
+  _NodePumpLoop();
+}
+
+static void _NodeRunLoopTimerCallback(CFRunLoopTimerRef timer, void *info) {
+  _NodePumpLoop();
+}
+
+
+void NodeAttachToMainRunLoop(CFTimeInterval pollInterval) {
+  kassert(pthread_main_np());
+  kassert(!KNodeRunLoopSource);
+  CFRunLoopRef runLoop = CFRunLoopGetMain();
+
+  // Signaled whenever something is enqueued from another thread
+  CFRunLoopSourceContext sourceContext = {0};
+  sourceContext.perform = &_NodeRunLoopSourcePerform;
+  CFRunLoopSourceRef runLoopSource =
+      CFRunLoopSourceCreate(NULL, 0, &sourceContext);
+  CFRunLoopAddSource(runLoop, runLoopSource, kCFRunLoopCommonModes);
+  pthread_mutex_lock(&KNodeRunLoopSourceLock);
+  KNodeRunLoopSource = runLoopSource;
+  pthread_mutex_unlock(&KNodeRunLoopSourceLock);
+
+  // Give node a go before the run loop goes to sleep, to pick up anything
+  // scheduled while the host was handling events
+  KNodeRunLoopObserver = CFRunLoopObserverCreate(
+      NULL, kCFRunLoopBeforeWaiting, true, 0,
+      &_NodeRunLoopObserverCallback, NULL);
+  CFRunLoopAddObserver(runLoop, KNodeRunLoopObserver, kCFRunLoopCommonModes);
+
+  // libev does not expose its backend nor its next timeout, so timers, I/O
+  // and async watchers signaled by node itself (e.g. libeio completions) are
+  // polled
+  KNodeRunLoopTimer = CFRunLoopTimerCreate(
+      NULL, CFAbsoluteTimeGetCurrent() + pollInterval, pollInterval, 0, 0,
+      &_NodeRunLoopTimerCallback, NULL);
+  CFRunLoopAddTimer(runLoop, KNodeRunLoopTimer, kCFRunLoopCommonModes);
+
+  NodeRunsOnMainRunLoop = true;
+  h_atomic_barrier();
+  // pick up anything enqueued by producers which did not see the flag yet
+  CFRunLoopSourceSignal(runLoopSource);
+}
+
+
+void NodeDetachFromMainRunLoop() {
+  NodeRunsOnMainRunLoop = false;
+  pthread_mutex_lock(&KNodeRunLoopSourceLock);
+  CFRunLoopSourceRef runLoopSource = KNodeRunLoopSource;
+  KNodeRunLoopSource = NULL;
+  pthread_mutex_unlock(&KNodeRunLoopSourceLock);
+  if (runLoopSource) {
+    CFRunLoopSourceInvalidate(runLoopSource);
+    CFRelease(runLoopSource);
+  }
+  if (KNodeRunLoopObserver) {
+    CFRunLoopObserverInvalidate(KNodeRunLoopObserver);
+    CFRelease(KNodeRunLoopObserver);
+    KNodeRunLoopObserver = NULL;
+  }
+  if (KNodeRunLoopTimer) {
+    CFRunLoopTimerInvalidate(KNodeRunLoopTimer);
+    CFRelease(KNodeRunLoopTimer);
+    KNodeRunLoopTimer = NULL;
+  }
 }
 
 static void _bindModule(const char *name, v8::Handle<Object> module) {
@@ -359,28 +689,47 @@ void initializeObjectProxy(const char *className, const char *sourceClassName) {
   _bindModule(className, function_instance);
 }
 
+// Estimated size of a nodeObjectMap entry named |name|
+static inline int64_t _ObjectMapEntrySize(const char *name) {
+  return sizeof(std::pair<std::string, v8::Persistent<v8::Object> >) +
+         strlen(name) + 1;
+}
+
 void registerNodeObject(const char *name, Persistent<Object> object) {
   v8::HandleScope scope;
   if (!object->IsObject()) return;
   unregisterNodeObject(name);
   nodeObjectMap[std::string(name)] = object;
+  ++nodeObjectMapGeneration;
+  KNodeCensusAdd(KNodeCensusObjectMapEntry, _ObjectMapEntrySize(name));
 }
 
 void unregisterNodeObject(const char *name) {
-  if (!nodeObjectMap.empty()) {
-    Persistent<Object> object = nodeObjectMap[std::string(name)];
-    object.Clear();
-    object.Dispose();
+  std::map<std::string, v8::Persistent<v8::Object> >::iterator it =
+      nodeObjectMap.find(std::string(name));
+  if (it != nodeObjectMap.end()) {
+    // lookups might have left empty entries behind, which are not counted
+    if (!it->second.IsEmpty())
+      KNodeCensusRemove(KNodeCensusObjectMapEntry, _ObjectMapEntrySize(name));
+    it->second.Dispose();
+    it->second.Clear();
+    nodeObjectMap.erase(it);
+    ++nodeObjectMapGeneration;
   }
 }
 
 void unregisterAllNodeObjects() {
-  if (!nodeObjectMap.empty()) {
-    std::map<std::string, v8::Persistent<v8::Object> >::iterator it;
-    for (it = nodeObjectMap.begin(); it != nodeObjectMap.end(); it++) {
-      unregisterNodeObject(it->first.c_str());
+  std::map<std::string, v8::Persistent<v8::Object> >::iterator it;
+  for (it = nodeObjectMap.begin(); it != nodeObjectMap.end(); it++) {
+    if (!it->second.IsEmpty()) {
+      KNodeCensusRemove(KNodeCensusObjectMapEntry,
+                        _ObjectMapEntrySize(it->first.c_str()));
     }
+    it->second.Dispose();
+    it->second.Clear();
   }
+  nodeObjectMap.clear();
+  ++nodeObjectMapGeneration;
 }
 
 
@@ -487,3 +836,104 @@ void NodeEventIOEntry::perform() {
   }
   NodeIOEntry::perform();
 }
+
+
+// ---------------------------------------------------------------------------
+
+KNodeEventChannel::KNodeEventChannel(const char *name, const char *objectName) {
+  kassert(name != NULL);
+  kassert(objectName != NULL);
+  name_ = strdup(name);
+  objectName_ = strdup(objectName);
+  generation_ = -1;
+}
+
+
+KNodeEventChannel::~KNodeEventChannel() {
+  unbind();
+  if (!symbol_.IsEmpty()) {
+    symbol_.Dispose();
+    symbol_.Clear();
+  }
+  free(name_); name_ = NULL;
+  free(objectName_); objectName_ = NULL;
+}
+
+
+void KNodeEventChannel::unbind() {
+  if (!target_.IsEmpty()) {
+    target_.Dispose();
+    target_.Clear();
+  }
+  if (!emit_.IsEmpty()) {
+    emit_.Dispose();
+    emit_.Clear();
+  }
+}
+
+
+// (Re)resolve the target and its emit function if the object map changed
+// since we last looked. Returns true if the channel is bound.
+bool KNodeEventChannel::resolve() {
+  if (generation_ == nodeObjectMapGeneration)
+    return !emit_.IsEmpty();
+
+  v8::HandleScope scope;
+  unbind();
+  generation_ = nodeObjectMapGeneration;
+
+  std::map<std::string, v8::Persistent<v8::Object> >::iterator it =
+      nodeObjectMap.find(std::string(objectName_));
+  if (it == nodeObjectMap.end() || it->second.IsEmpty())
+    return false;
+
+  Local<Value> emitFunction = it->second->Get(String::NewSymbol("emit"));
+  if (!emitFunction->IsFunction())
+    return false;
+
+  target_ = Persistent<Object>::New(it->second);
+  emit_ = Persistent<Function>::New(Local<Function>::Cast(emitFunction));
+  if (symbol_.IsEmpty())
+    symbol_ = Persistent<String>::New(String::NewSymbol(name_));
+  return true;
+}
+
+
+void KNodeEventChannel::emit(int argc, id *argv) {
+  v8::HandleScope scope;
+  if (resolve()) {
+    Local<Value> eventName = Local<Value>::New(symbol_);
+    KNodeCallFunction(target_, emit_, argc, argv, &eventName);
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+
+KNodeChannelEventIOEntry::KNodeChannelEventIOEntry(KNodeEventChannel *channel,
+                                                   id owner,
+                                                   int argc, id *argv) {
+  kassert(channel != NULL);
+  channel_ = channel;
+  owner_ = [owner retain];
+  argc_ = argc;
+  argv_ = argc ? new id[argc] : NULL;
+  for (int i = 0; i<argc_; ++i) {
+    argv_[i] = [argv[i] retain];
+  }
+}
+
+
+KNodeChannelEventIOEntry::~KNodeChannelEventIOEntry() {
+  for (int i = 0; i<argc_; ++i) {
+    [argv_[i] release];
+  }
+  delete [] argv_; argv_ = NULL;
+  [owner_ release]; owner_ = nil;
+}
+
+
+void KNodeChannelEventIOEntry::perform() {
+  channel_->emit(argc_, argv_);
+  NodeIOEntry::perform();
+}
@@ -6,10 +6,14 @@
 #import "NodeObjectProxy.h"
 #import "ExternalUTF16String.h"
 #import "NodeJSFunction.h"
+#import "node_trace.h"
+#import "node_census.h"
 
 #import <err.h>
 #import <node_buffer.h>
 #import <vector>
+#import <map>
+#import <list>
 #import <objc/runtime.h>
 
 using namespace v8;
@@ -79,6 +83,290 @@ class BuildContext {
 
 Persistent<Function> BuildContext::indexOf;
 
+
+// ----------------------------------------------------------------------------
+
+// max number of keys in a shaped object
+#define KNODE_SHAPE_MAX_KEYS 32
+
+// max number of shapes kept alive at any time
+#define KNODE_SHAPE_CACHE_SIZE 256
+
+// number of key set signatures remembered while waiting for a second sighting
+#define KNODE_SHAPE_SIGHTINGS 1024
+
+/*!
+ * An object shape is an ordered set of keys, together with pre-interned V8
+ * symbols and NSString copies of those keys.
+ *
+ * Dictionaries which share a key set are converted using an object template
+ * which already declares all properties (sorted by key), so that V8 gives all
+ * of them the same hidden class and we never create key strings. Objects
+ * coming from V8 whose property names match a known shape are read back by
+ * index, reusing the cached NSString keys.
+ *
+ * Shapes are only ever used in node. A key set is only given a shape the
+ * second time it is seen, so one-off objects never enter the cache. The cache
+ * holds at most KNODE_SHAPE_CACHE_SIZE shapes and evicts the least recently
+ * used one when full. Shapes are reference counted so that an evicted shape
+ * stays valid while a (possibly nested) conversion still uses it -- callers
+ * must Release() the shape returned by ForKeys/ForPropertyNames.
+ */
+class KNodeObjectShape {
+ public:
+  // Shape for a dictionary with |count| |keys|. Fills |indexes| with the
+  // property index of each key. Returns NULL if the dictionary should not be
+  // shaped.
+  static KNodeObjectShape *ForKeys(id *keys, NSUInteger count, int *indexes);
+
+  // Shape matching the property names of an object, or NULL
+  static KNodeObjectShape *ForPropertyNames(Local<Array> names);
+
+  inline NSUInteger count() const { return count_; }
+  inline NSString *key(NSUInteger i) const { return keys_[i]; }
+  inline Persistent<String> &symbol(NSUInteger i) { return symbols_[i]; }
+
+  Local<Object> NewInstance();
+
+  inline void Retain() { ++refs_; }
+  inline void Release() { if (--refs_ == 0) delete this; }
+
+ protected:
+  KNodeObjectShape(NSArray *keys, Local<Value> *symbols=NULL);
+  ~KNodeObjectShape();
+  bool indexesOfKeys(id *keys, int *indexes);
+  bool matchesPropertyNames(Local<Value> *names);
+
+  // True the second time |signature| is seen
+  static bool SeenBefore(NSUInteger signature);
+  // Adds a new shape to the cache, evicting the least recently used shape
+  static void Admit(KNodeObjectShape *shape);
+  static void Evict(KNodeObjectShape *shape);
+  // Marks |shape| as most recently used and retains it for the caller
+  static KNodeObjectShape *Touch(KNodeObjectShape *shape);
+
+  NSUInteger count_;
+  NSString *keys_[KNODE_SHAPE_MAX_KEYS];
+  CFMutableDictionaryRef indexes_;  // key -> index+1
+  std::vector<Persistent<String> > symbols_;
+  Persistent<ObjectTemplate> template_;
+  unsigned refs_;  // one for the cache plus one per caller
+  bool inDictionaryShapes_;
+  NSUInteger dictionaryHash_;
+  std::list<KNodeObjectShape*>::iterator lruPosition_;
+
+  // shapes for ObjC dictionaries keyed by key set hash
+  static std::multimap<NSUInteger, KNodeObjectShape*> dictionaryShapes_;
+  // shapes for V8 objects keyed by property count
+  static std::multimap<NSUInteger, KNodeObjectShape*> objectShapes_;
+  // all cached shapes, most recently used first
+  static std::list<KNodeObjectShape*> lru_;
+  // signatures of key sets seen once
+  static NSUInteger sightings_[KNODE_SHAPE_SIGHTINGS];
+};
+
+typedef std::multimap<NSUInteger, KNodeObjectShape*> KNodeShapeMap;
+
+KNodeShapeMap KNodeObjectShape::dictionaryShapes_;
+KNodeShapeMap KNodeObjectShape::objectShapes_;
+std::list<KNodeObjectShape*> KNodeObjectShape::lru_;
+NSUInteger KNodeObjectShape::sightings_[KNODE_SHAPE_SIGHTINGS];
+
+static Local<ObjectTemplate> _NewDictionaryTemplate();
+
+
+KNodeObjectShape::KNodeObjectShape(NSArray *keys, Local<Value> *symbols)
+    : refs_(1), inDictionaryShapes_(false), dictionaryHash_(0) {
+  HandleScope scope;
+  count_ = [keys count];
+  assert(count_ <= KNODE_SHAPE_MAX_KEYS);
+  indexes_ = CFDictionaryCreateMutable(NULL, count_,
+                                       &kCFTypeDictionaryKeyCallBacks, NULL);
+  for (NSUInteger i = 0; i < count_; ++i) {
+    keys_[i] = [[keys objectAtIndex:i] copy];
+    CFDictionarySetValue(indexes_, keys_[i], (const void*)(i + 1));
+    Local<String> symbol = symbols ? symbols[i]->ToString()
+                                   : String::NewSymbol([keys_[i] UTF8String]);
+    symbols_.push_back(Persistent<String>::New(symbol));
+  }
+}
+
+
+KNodeObjectShape::~KNodeObjectShape() {
+  for (NSUInteger i = 0; i < count_; ++i) {
+    [keys_[i] release];
+    symbols_[i].Dispose();
+  }
+  CFRelease(indexes_);
+  if (!template_.IsEmpty()) template_.Dispose();
+}
+
+
+bool KNodeObjectShape::indexesOfKeys(id *keys, int *indexes) {
+  for (NSUInteger i = 0; i < count_; ++i) {
+    const void *index = NULL;
+    if (!CFDictionaryGetValueIfPresent(indexes_, keys[i], &index))
+      return false;
+    indexes[i] = (int)((uintptr_t)index - 1);
+  }
+  return true;
+}
+
+
+bool KNodeObjectShape::matchesPropertyNames(Local<Value> *names) {
+  for (NSUInteger i = 0; i < count_; ++i) {
+    // property names are symbols, so this is usually an identity check
+    if (!names[i]->StrictEquals(symbols_[i]))
+      return false;
+  }
+  return true;
+}
+
+
+Local<Object> KNodeObjectShape::NewInstance() {
+  HandleScope scope;
+  if (template_.IsEmpty()) {
+    Local<ObjectTemplate> t = _NewDictionaryTemplate();
+    // declare all properties up front so every instance shares a hidden class
+    for (NSUInteger i = 0; i < count_; ++i)
+      t->Set(symbols_[i], Undefined());
+    template_ = Persistent<ObjectTemplate>::New(t);
+  }
+  return scope.Close(template_->NewInstance());
+}
+
+
+bool KNodeObjectShape::SeenBefore(NSUInteger signature) {
+  NSUInteger &slot = sightings_[signature % KNODE_SHAPE_SIGHTINGS];
+  if (slot == signature) {
+    slot = 0;
+    return true;
+  }
+  slot = signature;
+  return false;
+}
+
+
+void KNodeObjectShape::Admit(KNodeObjectShape *shape) {
+  while (lru_.size() >= KNODE_SHAPE_CACHE_SIZE)
+    Evict(lru_.back());
+  lru_.push_front(shape);
+  shape->lruPosition_ = lru_.begin();
+  // objects created from a dictionary shape keep their property order, so
+  // every shape is also used to recognize objects coming back from V8
+  objectShapes_.insert(std::make_pair(shape->count_, shape));
+  if (shape->inDictionaryShapes_)
+    dictionaryShapes_.insert(std::make_pair(shape->dictionaryHash_, shape));
+}
+
+
+static void _KNodeShapeMapErase(KNodeShapeMap &map, NSUInteger key,
+                                KNodeObjectShape *shape) {
+  std::pair<KNodeShapeMap::iterator, KNodeShapeMap::iterator> range =
+      map.equal_range(key);
+  for (KNodeShapeMap::iterator it = range.first; it != range.second; ++it) {
+    if (it->second == shape) {
+      map.erase(it);
+      return;
+    }
+  }
+}
+
+
+void KNodeObjectShape::Evict(KNodeObjectShape *shape) {
+  _KNodeShapeMapErase(objectShapes_, shape->count_, shape);
+  if (shape->inDictionaryShapes_)
+    _KNodeShapeMapErase(dictionaryShapes_, shape->dictionaryHash_, shape);
+  lru_.erase(shape->lruPosition_);
+  // disposes the template and symbols unless a conversion still uses it
+  shape->Release();
+}
+
+
+KNodeObjectShape *KNodeObjectShape::Touch(KNodeObjectShape *shape) {
+  if (shape->lruPosition_ != lru_.begin())
+    lru_.splice(lru_.begin(), lru_, shape->lruPosition_);
+  shape->Retain();
+  return shape;
+}
+
+
+KNodeObjectShape *KNodeObjectShape::ForKeys(id *keys, NSUInteger count,
+                                            int *indexes) {
+  if (count == 0 || count > KNODE_SHAPE_MAX_KEYS)
+    return NULL;
+
+  // order independent hash of the key set
+  NSUInteger hash = count;
+  for (NSUInteger i = 0; i < count; ++i)
+    hash += [keys[i] hash];
+
+  std::pair<KNodeShapeMap::iterator, KNodeShapeMap::iterator> range =
+      dictionaryShapes_.equal_range(hash);
+  for (KNodeShapeMap::iterator it = range.first; it != range.second; ++it) {
+    KNodeObjectShape *shape = it->second;
+    if (shape->count_ == count && shape->indexesOfKeys(keys, indexes))
+      return Touch(shape);
+  }
+
+  if (!SeenBefore(hash))
+    return NULL;
+
+  NSArray *sortedKeys = [[NSArray arrayWithObjects:keys count:count]
+                         sortedArrayUsingSelector:@selector(compare:)];
+  KNodeObjectShape *shape = new KNodeObjectShape(sortedKeys);
+  shape->inDictionaryShapes_ = true;
+  shape->dictionaryHash_ = hash;
+  Admit(shape);
+
+  shape->indexesOfKeys(keys, indexes);
+  shape->Retain();
+  return shape;
+}
+
+
+KNodeObjectShape *KNodeObjectShape::ForPropertyNames(Local<Array> props) {
+  NSUInteger count = props->Length();
+  if (count == 0 || count > KNODE_SHAPE_MAX_KEYS)
+    return NULL;
+
+  Local<Value> names[KNODE_SHAPE_MAX_KEYS];
+  for (NSUInteger i = 0; i < count; ++i)
+    names[i] = props->Get(i);
+
+  std::pair<KNodeShapeMap::iterator, KNodeShapeMap::iterator> range =
+      objectShapes_.equal_range(count);
+  for (KNodeShapeMap::iterator it = range.first; it != range.second; ++it) {
+    if (it->second->matchesPropertyNames(names))
+      return Touch(it->second);
+  }
+
+  // cheap signature of the (ordered) property names: length and leading
+  // characters of each name
+  NSUInteger signature = count;
+  for (NSUInteger i = 0; i < count; ++i) {
+    // only plain string keys (no array indices)
+    if (!names[i]->IsString())
+      return NULL;
+    Local<String> name = names[i]->ToString();
+    uint16_t chars[4] = {0, 0, 0, 0};
+    name->Write(chars, 0, 4);
+    signature = signature * 31 + name->Length();
+    for (int c = 0; c < 4; ++c)
+      signature = signature * 31 + chars[c];
+  }
+  if (!SeenBefore(signature))
+    return NULL;
+
+  NSMutableArray *keys = [NSMutableArray arrayWithCapacity:count];
+  for (NSUInteger i = 0; i < count; ++i)
+    [keys addObject:[NSString stringWithV8String:names[i]->ToString()]];
+  KNodeObjectShape *shape = new KNodeObjectShape(keys, names);
+  Admit(shape);
+  shape->Retain();
+  return shape;
+}
+
 @implementation NSObject (v8)
 
 + (id)fromV8Value:(v8::Local<v8::Value>)v buildContext:(BuildContext*)bctx {
@@ -154,6 +442,18 @@ Persistent<Function> BuildContext::indexOf;
     NSMutableDictionary* dict =
         [NSMutableDictionary dictionaryWithCapacity:count];
     bctx->SetObjectForValue(dict, v);
+    KNodeObjectShape *shape = KNodeObjectShape::ForPropertyNames(props);
+    if (shape) {
+      // known shape -- read by index using the cached keys
+      for (; i < count; ++i) {
+        NSObject *vobj = [self fromV8Value:o->Get(shape->symbol(i))
+                              buildContext:bctx];
+        if (vobj)
+          [dict setObject:vobj forKey:shape->key(i)];
+      }
+      shape->Release();
+      return dict;
+    }
     for (; i < count; ++i) {
       Local<String> k = props->Get(i)->ToString();
       NSString *kobj = [NSString stringWithV8String:k];
@@ -167,8 +467,26 @@ Persistent<Function> BuildContext::indexOf;
   return nil;
 }
 
+// Number of elements in |v| as far as the tracer is concerned: characters,
+// bytes, array items or property names. Values are never read, so tracing does
+// not run getters or interceptors.
+static size_t _V8ValueTraceSize(v8::Local<v8::Value> v) {
+  if (v.IsEmpty()) return 0;
+  if (v->IsString()) return Local<String>::Cast(v)->Length();
+  if (!v->IsObject() || v->IsFunction() || v->IsDate() || v->IsRegExp())
+    return 0;
+  if (v->IsArray()) return Local<Array>::Cast(v)->Length();
+  HandleScope scope;
+  Local<Object> obj = v->ToObject();
+  if (node::Buffer::HasInstance(obj))
+    return node::Buffer::Length(obj);
+  return obj->GetPropertyNames()->Length();
+}
+
 + (id)fromV8Value:(v8::Local<v8::Value>)v {
   BuildContext bctx;
+  KNODE_TRACE_CONVERSION("fromV8Value",
+                         KNodeTraceEnabled ? _V8ValueTraceSize(v) : 0);
   return [self fromV8Value:v buildContext:&bctx];
 }
 
@@ -241,6 +559,7 @@ Persistent<Function> BuildContext::indexOf;
 - (Local<Value>)v8Value {
   HandleScope scope;
   NSUInteger i = 0, count = [self count];
+  KNODE_TRACE_CONVERSION("v8Value", count);
   Local<Array> a = Array::New((int) count);
   for (; i < count; i++) {
     a->Set((int) i, [[self objectAtIndex:i] v8Value]);
@@ -253,6 +572,7 @@ Persistent<Function> BuildContext::indexOf;
 - (Local<Value>)v8Value {
   HandleScope scope;
   NSUInteger i = 0, count = [self count];
+  KNODE_TRACE_CONVERSION("v8Value", count);
   Local<Array> a = Array::New((int) count);
   for (NSObject* obj in self) {
     a->Set((int) i++, [obj v8Value]);
@@ -268,8 +588,10 @@ class MutableDictionaryProxy {
     NSDictionary *wrappedDictionary_;
     MutableDictionaryProxy(NSDictionary *dictionary) {
       wrappedDictionary_ = [dictionary retain];
+      KNodeCensusAdd(KNodeCensusDictionaryProxy, sizeof(MutableDictionaryProxy));
     }
     ~MutableDictionaryProxy() {
+      KNodeCensusRemove(KNodeCensusDictionaryProxy, sizeof(MutableDictionaryProxy));
       [wrappedDictionary_ release];
     }
 
@@ -310,10 +632,8 @@ static Handle<Value> MutableDictionarySetter(Local<String> property,
   return scope.Close(empty);
 }
 
-@implementation NSDictionary (v8)
-- (Local<Value>)v8Value {
+static Local<ObjectTemplate> _NewDictionaryTemplate() {
   HandleScope scope;
-
   Local<ObjectTemplate> dictTemplate = ObjectTemplate::New();
   // Differentiate this from NodeObjectProxy's number of internal fields
   dictTemplate->SetInternalFieldCount(2);
@@ -323,17 +643,50 @@ static Handle<Value> MutableDictionarySetter(Local<String> property,
                                        NULL,
                                        NULL,
                                        Undefined());
-  Persistent<Object> dict = Persistent<Object>::New(dictTemplate->NewInstance());
+  return scope.Close(dictTemplate);
+}
+
+@implementation NSDictionary (v8)
+- (Local<Value>)v8Value {
+  HandleScope scope;
+  NSUInteger count = [self count];
+  KNODE_TRACE_CONVERSION("v8Value", count);
+
+  // Template for dictionaries which are not shaped
+  static Persistent<ObjectTemplate> dictTemplate;
+  if (dictTemplate.IsEmpty())
+    dictTemplate = Persistent<ObjectTemplate>::New(_NewDictionaryTemplate());
+
+  id keys[KNODE_SHAPE_MAX_KEYS];
+  id objects[KNODE_SHAPE_MAX_KEYS];
+  int indexes[KNODE_SHAPE_MAX_KEYS];
+  KNodeObjectShape *shape = NULL;
+  if (count <= KNODE_SHAPE_MAX_KEYS) {
+    [self getObjects:objects andKeys:keys];
+    shape = KNodeObjectShape::ForKeys(keys, count, indexes);
+  }
+
+  Persistent<Object> dict = Persistent<Object>::New(
+      shape ? shape->NewInstance() : dictTemplate->NewInstance());
 
   // Wrap this dictionary instance and make sure it stays alive until this object is no longer referenced
   MutableDictionaryProxy *dictProxy = new MutableDictionaryProxy(self);
   dict->SetInternalField(0, External::New(dictProxy));
   dict.MakeWeak(dictProxy, MutableDictionaryProxy::WeakCallback);
 
-  [self enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
-    assert([key isKindOfClass:[NSString class]]);
-    dict->Set(String::New([key UTF8String]), [obj v8Value]);
-  }];
+  // Both paths use ForceSet, which bypasses the setter interceptor. Set would
+  // write converted copies of the values back into ourselves, and whether a
+  // dictionary is shaped must not change the result.
+  if (shape) {
+    for (NSUInteger i = 0; i < count; ++i)
+      dict->ForceSet(shape->symbol(indexes[i]), [objects[i] v8Value]);
+    shape->Release();
+  } else {
+    [self enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
+      assert([key isKindOfClass:[NSString class]]);
+      dict->ForceSet(String::New([key UTF8String]), [obj v8Value]);
+    }];
+  }
 
   return scope.Close(dict);
 }
@@ -341,17 +694,151 @@ static Handle<Value> MutableDictionarySetter(Local<String> property,
 
 // ----------------------------------------------------------------------------
 
+// Strings shorter than this are copied into regular V8 strings since an
+// external resource costs more than it saves
+#define KNODE_EXTERNAL_STRING_MIN_LENGTH 128
+
+/*!
+ * External string resources which refer directly to the storage of an
+ * immutable NSString (which they retain) rather than to a copy. The size of
+ * the string is reported to V8 as external memory for as long as the resource
+ * lives. Resources are deleted by V8 when the string is collected.
+ */
+class KNodeNSStringResource : public String::ExternalStringResource {
+ public:
+  KNodeNSStringResource(NSString *str, const UniChar *data, size_t length)
+      : str_([str retain]), data_((const uint16_t *)data), length_(length) {
+    V8::AdjustAmountOfExternalAllocatedMemory(length_ * sizeof(uint16_t));
+    KNodeCensusAdd(KNodeCensusExternalNSString, length_ * sizeof(uint16_t));
+  }
+  virtual ~KNodeNSStringResource() {
+    KNodeCensusRemove(KNodeCensusExternalNSString, length_ * sizeof(uint16_t));
+    V8::AdjustAmountOfExternalAllocatedMemory(-(int)(length_ * sizeof(uint16_t)));
+    [str_ release];
+  }
+  virtual const uint16_t* data() const { return data_; }
+  virtual size_t length() const { return length_; }
+ protected:
+  NSString *str_;
+  const uint16_t *data_;
+  size_t length_;
+};
+
+class KNodeNSStringAsciiResource : public String::ExternalAsciiStringResource {
+ public:
+  KNodeNSStringAsciiResource(NSString *str, const char *data, size_t length)
+      : str_([str retain]), data_(data), length_(length) {
+    V8::AdjustAmountOfExternalAllocatedMemory(length_);
+    KNodeCensusAdd(KNodeCensusExternalNSString, length_);
+  }
+  virtual ~KNodeNSStringAsciiResource() {
+    KNodeCensusRemove(KNodeCensusExternalNSString, length_);
+    V8::AdjustAmountOfExternalAllocatedMemory(-(int)length_);
+    [str_ release];
+  }
+  virtual const char* data() const { return data_; }
+  virtual size_t length() const { return length_; }
+ protected:
+  NSString *str_;
+  const char *data_;
+  size_t length_;
+};
+
+// A copy of the characters of an NSString, reported to V8 as external memory
+class KNodeExternalUTF16String : public kod::ExternalUTF16String {
+ public:
+  KNodeExternalUTF16String(NSString *src) : kod::ExternalUTF16String(src) {
+    size_ = length_ * sizeof(uint16_t);
+    V8::AdjustAmountOfExternalAllocatedMemory(size_);
+  }
+  virtual ~KNodeExternalUTF16String() {
+    V8::AdjustAmountOfExternalAllocatedMemory(-size_);
+  }
+ protected:
+  int size_;
+};
+
+// Returns |chars| if all |length| of them are 7-bit ASCII, otherwise NULL
+static inline const char *_ASCIIOrNull(const char *chars, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    if (chars[i] & 0x80) return NULL;
+  }
+  return chars;
+}
+
+// True for 8-bit encodings which agree with ASCII on 0-127
+static inline bool _IsASCIICompatibleEncoding(CFStringEncoding encoding) {
+  switch (encoding) {
+    case kCFStringEncodingASCII:
+    case kCFStringEncodingMacRoman:
+    case kCFStringEncodingISOLatin1:
+    case kCFStringEncodingWindowsLatin1:
+    case kCFStringEncodingNextStepLatin:
+    case kCFStringEncodingUTF8:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// The storage of |str| if it is a pure ASCII 8-bit string, or NULL.
+// CFStringGetCStringPtr only returns storage when asked for the string's
+// internal 8-bit encoding, which is usually the system encoding (MacRoman)
+// rather than ASCII, so ask for that.
+static const char *_CFStringASCIIPtr(CFStringRef str, size_t length) {
+  CFStringEncoding encodings[] = {
+    CFStringGetFastestEncoding(str),
+    CFStringGetSystemEncoding(),
+    kCFStringEncodingASCII,
+  };
+  for (size_t i = 0; i < sizeof(encodings) / sizeof(encodings[0]); ++i) {
+    if (!_IsASCIICompatibleEncoding(encodings[i])) continue;
+    const char *chars = CFStringGetCStringPtr(str, encodings[i]);
+    // the bytes are only valid one-byte V8 string data if they're all ASCII
+    if (chars) return _ASCIIOrNull(chars, length);
+  }
+  return NULL;
+}
+
+
 @implementation NSString (v8)
 
 - (Local<Value>)v8Value {
   HandleScope scope;
+  NSUInteger length = [self length];
+  KNODE_TRACE_CONVERSION("v8Value", length);
+
+  if (length < KNODE_EXTERNAL_STRING_MIN_LENGTH) {
+    const char *ascii = _CFStringASCIIPtr((CFStringRef)self, length);
+    if (ascii)
+      return scope.Close(String::New(ascii, length));
+    uint16_t chars[KNODE_EXTERNAL_STRING_MIN_LENGTH];
+    [self getCharacters:chars range:NSMakeRange(0, length)];
+    return scope.Close(String::New(chars, length));
+  }
+
+  // Our resources refer to the string's own storage, so make sure it can't
+  // change under us. For immutable strings this is only a retain.
+  NSString *str = [self copy];
+  Local<String> v;
+
+  // V8 only supports 7-bit ASCII for one-byte strings, so 8-bit strings are
+  // only used as-is when they don't use any of the upper half
+  const char *ascii = _CFStringASCIIPtr((CFStringRef)str, length);
 
-  // Note: For a custom NSString class where we have access to the underlying
-  // characters, we can use an ExternalStringResource to avoid doing any
-  // copies at all:
-  //String::NewExternal(ExternalStringResource* resource);
+  if (ascii) {
+    v = String::NewExternal(new KNodeNSStringAsciiResource(str, ascii, length));
+  } else {
+    const UniChar *utf16 = CFStringGetCharactersPtr((CFStringRef)str);
+    if (utf16) {
+      v = String::NewExternal(new KNodeNSStringResource(str, utf16, length));
+    } else {
+      v = String::NewExternal(new KNodeExternalUTF16String(str));
+    }
+  }
 
-  return scope.Close(String::NewExternal(new kod::ExternalUTF16String(self)));
+  [str release];
+  return scope.Close(v);
 }
 
 + (NSString*)stringWithV8String:(Local<String>)str {
@@ -366,6 +853,7 @@ static Handle<Value> MutableDictionarySetter(Local<String> property,
 @implementation NSData (node)
 - (Local<Value>)v8Value {
   HandleScope scope;
+  KNODE_TRACE_CONVERSION("v8Value", [self length]);
 
   // Note: The following _might_ cause a race condition if called at the same
   // time by two node threads and might cause unknown magic spooky stuff if
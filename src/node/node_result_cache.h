@@ -0,0 +1,38 @@
+// Copyright (c) 2010-2011, Rasmus Andersson. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#ifndef KNODE_RESULT_CACHE_H_
+#define KNODE_RESULT_CACHE_H_
+
+#import <Foundation/Foundation.h>
+#import "CoreNode.h"
+
+/*!
+ * Result cache for pure JS functions invoked from ObjC.
+ *
+ * Results of successful invocations of a cacheable function are kept on the
+ * ObjC side, keyed by the arguments, for |ttl| seconds. Arguments match if
+ * they are equal, except that booleans never match numbers. Results are deep copied
+ * into immutable containers since every hit shares them. Hits are answered on
+ * the calling thread without touching node, and identical invocations made
+ * while one is already in flight are collapsed into that invocation.
+ *
+ * All functions are thread safe.
+ */
+
+// Make |functionName| on |objectName| cacheable, keeping at most |maxEntries|
+// results (the least recently used are dropped first). Passing 0 for
+// |maxEntries| makes the function uncacheable and drops its cached results.
+void KNodeResultCacheSetCacheable(NSString *objectName, NSString *functionName,
+                                  NSUInteger maxEntries, NSTimeInterval ttl);
+
+// Invoke |functionName| on |objectName| through the cache. Returns NO without
+// doing anything if the function is not cacheable, which is cheap and does
+// not synchronize with other threads when no function with that name is. On a hit, |callback| is
+// called before this function returns. Otherwise |callback| is called on the
+// current queue once the (possibly shared) invocation finishes.
+BOOL KNodeResultCacheInvoke(NSString *objectName, NSString *functionName,
+                            NSArray *args, NodeCallbackBlock callback);
+
+#endif  // KNODE_RESULT_CACHE_H_
@@ -0,0 +1,392 @@
+// Copyright (c) 2010-2011, Rasmus Andersson. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#import "node_result_cache.h"
+#import "node_interface.h"
+#import "common.h"
+#import <objc/runtime.h>
+
+
+// Returns a retained deep copy of |obj| in which all arrays and dictionaries
+// are immutable, so cached values can be shared without callers being able to
+// change them for each other.
+static id _ImmutableCopy(id obj) {
+  if ([obj isKindOfClass:[NSArray class]]) {
+    NSUInteger count = [obj count];
+    NSMutableArray *items = [NSMutableArray arrayWithCapacity:count];
+    for (id item in obj) {
+      id copy = _ImmutableCopy(item);
+      [items addObject:copy];
+      [copy release];
+    }
+    return [[NSArray alloc] initWithArray:items];
+  }
+  if ([obj isKindOfClass:[NSDictionary class]]) {
+    NSMutableDictionary *items =
+        [NSMutableDictionary dictionaryWithCapacity:[obj count]];
+    for (id key in obj) {
+      id copy = _ImmutableCopy([obj objectForKey:key]);
+      [items setObject:copy forKey:key];
+      [copy release];
+    }
+    return [[NSDictionary alloc] initWithDictionary:items];
+  }
+  if ([obj conformsToProtocol:@protocol(NSCopying)])
+    return [obj copy];
+  return [obj retain];
+}
+
+
+// True if |number| converts to a JS boolean (e.g. a CFBoolean) rather than
+// to a JS number
+static inline BOOL _IsBooleanNumber(NSNumber *number) {
+  const char *type = [number objCType];
+  return type[0] == _C_BOOL || type[0] == _C_CHR;
+}
+
+
+// Like isEqual: but booleans never match numbers. NSNumber considers @YES
+// equal to @1, while they convert to different JS values. Numbers of
+// different C types but equal value convert to the same JS number.
+static BOOL _ArgumentsEqual(id a, id b) {
+  if (a == b) return YES;
+  if ([a isKindOfClass:[NSNumber class]]) {
+    return [b isKindOfClass:[NSNumber class]] &&
+           _IsBooleanNumber(a) == _IsBooleanNumber(b) &&
+           [a isEqualToNumber:b];
+  }
+  if ([a isKindOfClass:[NSArray class]]) {
+    if (![b isKindOfClass:[NSArray class]] || [a count] != [b count])
+      return NO;
+    NSUInteger i = 0;
+    for (id item in a) {
+      if (!_ArgumentsEqual(item, [b objectAtIndex:i++]))
+        return NO;
+    }
+    return YES;
+  }
+  if ([a isKindOfClass:[NSDictionary class]]) {
+    if (![b isKindOfClass:[NSDictionary class]] || [a count] != [b count])
+      return NO;
+    for (id key in a) {
+      id value = [b objectForKey:key];
+      if (!value || !_ArgumentsEqual([a objectForKey:key], value))
+        return NO;
+    }
+    return YES;
+  }
+  return [a isEqual:b];
+}
+
+
+// Arguments of an invocation. NSArray's hash is just its count, which is
+// useless for telling apart invocations of the same function, so we combine
+// the hashes of the elements instead.
+@interface KNodeResultCacheKey : NSObject <NSCopying> {
+ @public
+  NSArray *args_;
+  NSUInteger hash_;
+}
+- (id)initWithArguments:(NSArray *)args;
+@end
+
+@implementation KNodeResultCacheKey
+
+- (id)initWithArguments:(NSArray *)args {
+  if ((self = [super init])) {
+    args_ = args ? _ImmutableCopy(args) : [[NSArray alloc] init];
+    hash_ = [args_ count];
+    for (id arg in args_)
+      hash_ = hash_ * 31 + [arg hash];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [args_ release];
+  [super dealloc];
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+  // immutable
+  return [self retain];
+}
+
+- (NSUInteger)hash {
+  return hash_;
+}
+
+- (BOOL)isEqual:(id)other {
+  if (other == self) return YES;
+  if (![other isKindOfClass:[KNodeResultCacheKey class]]) return NO;
+  KNodeResultCacheKey *key = (KNodeResultCacheKey *)other;
+  return hash_ == key->hash_ && _ArgumentsEqual(args_, key->args_);
+}
+
+@end
+
+
+// A cached result, or an invocation in flight if |waiters_| is set. Cached
+// results are linked into their function's LRU list.
+@interface KNodeResultCacheEntry : NSObject {
+ @public
+  KNodeResultCacheKey *key_;
+  NSArray *results_;
+  CFAbsoluteTime expires_;
+  NSMutableArray *waiters_;
+  KNodeResultCacheEntry *prev_;  // weak
+  KNodeResultCacheEntry *next_;  // weak
+}
+@end
+
+@implementation KNodeResultCacheEntry
+- (void)dealloc {
+  [key_ release];
+  [results_ release];
+  [waiters_ release];
+  [super dealloc];
+}
+@end
+
+
+// Cached results of one function
+@interface KNodeFunctionResultCache : NSObject {
+ @public
+  NSUInteger maxEntries_;
+  NSTimeInterval ttl_;
+  NSMutableDictionary *entries_;
+  NSUInteger completedCount_;
+  // cached results, most recently used first (owned by |entries_|)
+  KNodeResultCacheEntry *lruHead_;
+  KNodeResultCacheEntry *lruTail_;
+}
+@end
+
+@implementation KNodeFunctionResultCache
+- (id)init {
+  if ((self = [super init])) {
+    entries_ = [[NSMutableDictionary alloc] init];
+  }
+  return self;
+}
+- (void)dealloc {
+  [entries_ release];
+  [super dealloc];
+}
+@end
+
+
+// Function caches keyed by object name and then function name. Only accessed
+// on KNodeResultCacheQueue.
+static NSMutableDictionary *KNodeResultCaches = nil;
+static dispatch_queue_t KNodeResultCacheQueue = NULL;
+static dispatch_once_t KNodeResultCacheOnce;
+
+// Number of cacheable functions, by slot of their name hash. Lets
+// KNodeResultCacheInvoke reject functions which are not cacheable without
+// building a key or entering KNodeResultCacheQueue.
+#define KNODE_RESULT_CACHE_NAME_SLOTS 64
+static volatile int32_t KNodeResultCacheNameCounts[KNODE_RESULT_CACHE_NAME_SLOTS];
+
+static inline volatile int32_t *_NameCount(NSString *functionName) {
+  return &KNodeResultCacheNameCounts[[functionName hash] %
+                                     KNODE_RESULT_CACHE_NAME_SLOTS];
+}
+
+
+static void _InitResultCache(void *unused) {
+  KNodeResultCaches = [[NSMutableDictionary alloc] init];
+  KNodeResultCacheQueue = dispatch_queue_create("node.resultcache", NULL);
+}
+
+// Cache of |functionName| on |objectName|, or nil. Called on
+// KNodeResultCacheQueue.
+static KNodeFunctionResultCache *_FunctionCache(NSString *objectName,
+                                                NSString *functionName) {
+  return [[KNodeResultCaches objectForKey:objectName]
+          objectForKey:functionName];
+}
+
+
+static void _LinkResult(KNodeFunctionResultCache *cache,
+                        KNodeResultCacheEntry *entry) {
+  entry->prev_ = nil;
+  entry->next_ = cache->lruHead_;
+  if (cache->lruHead_) cache->lruHead_->prev_ = entry;
+  cache->lruHead_ = entry;
+  if (!cache->lruTail_) cache->lruTail_ = entry;
+}
+
+
+static void _UnlinkResult(KNodeFunctionResultCache *cache,
+                          KNodeResultCacheEntry *entry) {
+  if (entry->prev_) entry->prev_->next_ = entry->next_;
+  else cache->lruHead_ = entry->next_;
+  if (entry->next_) entry->next_->prev_ = entry->prev_;
+  else cache->lruTail_ = entry->prev_;
+  entry->prev_ = entry->next_ = nil;
+}
+
+
+// Drops a cached result. Called on KNodeResultCacheQueue.
+static void _RemoveResult(KNodeFunctionResultCache *cache,
+                          KNodeResultCacheEntry *entry) {
+  _UnlinkResult(cache, entry);
+  --cache->completedCount_;
+  // |entry| (and its key) may be deallocated by the removal
+  KNodeResultCacheKey *key = [entry->key_ retain];
+  [cache->entries_ removeObjectForKey:key];
+  [key release];
+}
+
+
+// Makes room for one more result in |cache| by dropping the least recently
+// used results. Called on KNodeResultCacheQueue.
+static void _EvictResults(KNodeFunctionResultCache *cache) {
+  while (cache->completedCount_ >= cache->maxEntries_ && cache->lruTail_)
+    _RemoveResult(cache, cache->lruTail_);
+}
+
+
+void KNodeResultCacheSetCacheable(NSString *objectName, NSString *functionName,
+                                  NSUInteger maxEntries, NSTimeInterval ttl) {
+  dispatch_once_f(&KNodeResultCacheOnce, NULL, &_InitResultCache);
+  dispatch_sync(KNodeResultCacheQueue, ^{
+    NSMutableDictionary *functionCaches =
+        [KNodeResultCaches objectForKey:objectName];
+    if (maxEntries == 0) {
+      if ([functionCaches objectForKey:functionName])
+        h_atomic_dec(_NameCount(functionName));
+      // in-flight invocations still deliver to their waiters
+      [functionCaches removeObjectForKey:functionName];
+      if ([functionCaches count] == 0)
+        [KNodeResultCaches removeObjectForKey:objectName];
+      return;
+    }
+    if (!functionCaches) {
+      functionCaches = [NSMutableDictionary dictionary];
+      [KNodeResultCaches setObject:functionCaches forKey:objectName];
+    }
+    KNodeFunctionResultCache *cache =
+        [functionCaches objectForKey:functionName];
+    if (!cache) {
+      cache = [[[KNodeFunctionResultCache alloc] init] autorelease];
+      [functionCaches setObject:cache forKey:functionName];
+      h_atomic_inc(_NameCount(functionName));
+    }
+    cache->maxEntries_ = maxEntries;
+    cache->ttl_ = ttl;
+    while (cache->completedCount_ > cache->maxEntries_)
+      _RemoveResult(cache, cache->lruTail_);
+  });
+}
+
+
+BOOL KNodeResultCacheInvoke(NSString *objectName, NSString *functionName,
+                            NSArray *args, NodeCallbackBlock callback) {
+  // fast path for functions which are not cacheable. A function made
+  // cacheable concurrently with this call may be missed, which is fine.
+  if (*_NameCount(functionName) == 0)
+    return NO;
+
+  dispatch_once_f(&KNodeResultCacheOnce, NULL, &_InitResultCache);
+  KNodeResultCacheKey *key =
+      [[[KNodeResultCacheKey alloc] initWithArguments:args] autorelease];
+
+  // Waiters other than the first are called on their own queue
+  dispatch_queue_t callerQueue = dispatch_get_current_queue();
+  dispatch_retain(callerQueue);
+  NodeCallbackBlock waiter = ^(NSError *err, NSArray *results) {
+    dispatch_async(callerQueue, ^{
+      if (callback) callback(err, results);
+    });
+    dispatch_release(callerQueue);
+  };
+
+  __block BOOL cacheable = NO;
+  __block BOOL shouldInvoke = NO;
+  __block NSArray *hit = nil;
+  __block KNodeResultCacheEntry *pending = nil;
+  dispatch_sync(KNodeResultCacheQueue, ^{
+    KNodeFunctionResultCache *cache = _FunctionCache(objectName, functionName);
+    if (!cache) return;
+    cacheable = YES;
+    KNodeResultCacheEntry *entry = [cache->entries_ objectForKey:key];
+    if (entry && !entry->waiters_) {
+      if (entry->expires_ > CFAbsoluteTimeGetCurrent()) {
+        // most recently used
+        _UnlinkResult(cache, entry);
+        _LinkResult(cache, entry);
+        hit = [entry->results_ retain];
+        return;
+      }
+      // expired
+      _RemoveResult(cache, entry);
+      entry = nil;
+    }
+    if (entry) {
+      // collapse into the invocation in flight
+      [entry->waiters_ addObject:[[waiter copy] autorelease]];
+    } else {
+      entry = [[[KNodeResultCacheEntry alloc] init] autorelease];
+      entry->key_ = [key retain];
+      entry->waiters_ = [[NSMutableArray alloc] init];
+      [cache->entries_ setObject:entry forKey:key];
+      pending = [entry retain];
+      shouldInvoke = YES;
+    }
+  });
+
+  if (!cacheable || hit || shouldInvoke) {
+    // |waiter| was not queued
+    dispatch_release(callerQueue);
+  }
+  if (!cacheable) return NO;
+
+  if (hit) {
+    if (callback) callback(nil, hit);
+    [hit release];
+    return YES;
+  }
+
+  if (shouldInvoke) {
+    // released once the invocation has finished
+    KNodeResultCacheEntry *inFlight = pending;
+    nodeInvokeFunction([functionName UTF8String], [objectName UTF8String], args,
+                       ^(NSError *err, NSArray *results) {
+      // called on the queue of the first caller
+      __block NSArray *waiters = nil;
+      // every caller gets the same (cached) results, so none of them must be
+      // able to mutate them
+      results = [_ImmutableCopy(results) autorelease];
+      dispatch_sync(KNodeResultCacheQueue, ^{
+        // the function might have been made uncacheable while we were in
+        // flight, in which case our entry is no longer in the cache
+        KNodeFunctionResultCache *cache =
+            _FunctionCache(objectName, functionName);
+        if (cache && [cache->entries_ objectForKey:key] == inFlight) {
+          if (err) {
+            // errors are not cached
+            [cache->entries_ removeObjectForKey:key];
+          } else {
+            // evict while our entry still counts as in flight
+            _EvictResults(cache);
+            inFlight->results_ = [results retain];
+            inFlight->expires_ = CFAbsoluteTimeGetCurrent() + cache->ttl_;
+            _LinkResult(cache, inFlight);
+            ++cache->completedCount_;
+          }
+        }
+        waiters = inFlight->waiters_;
+        inFlight->waiters_ = nil;
+      });
+      if (callback) callback(err, results);
+      for (NodeCallbackBlock w in waiters)
+        w(err, results);
+      [waiters release];
+      [inFlight release];
+    });
+  }
+  return YES;
+}
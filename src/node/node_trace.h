@@ -0,0 +1,87 @@
+// Copyright (c) 2010-2011, Rasmus Andersson. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#ifndef KNODE_TRACE_H_
+#define KNODE_TRACE_H_
+
+#import <Foundation/Foundation.h>
+#include <stdint.h>
+
+/*!
+ * Bridge activity tracer.
+ *
+ * Records spans (enqueue, queue drains, entry performs, large conversions,
+ * proxy accessors, GC pauses and callback delivery) into per-thread buffers
+ * which are only ever written by their owning thread, so recording is
+ * lock-free. The result can be exported as Chrome trace-event JSON and loaded
+ * in chrome://tracing.
+ *
+ * When tracing is stopped, the cost of a trace point is a single load.
+ */
+
+// Non-zero while recording. Read-only, use KNodeTraceStart/KNodeTraceStop.
+extern volatile int32_t KNodeTraceEnabled;
+
+// Conversions of values with at least this many elements (array items,
+// dictionary entries, characters or bytes) are traced. Defaults to 1024.
+extern size_t KNodeTraceConversionThreshold;
+
+// Start recording. Discards any previously recorded events.
+void KNodeTraceStart();
+
+// Stop recording. Recorded events are kept until the next start.
+void KNodeTraceStop();
+
+// Returns the recorded events as Chrome trace-event JSON. Should be called
+// after KNodeTraceStop, or events still being recorded might be missed.
+// Events which did not fit in their thread's buffer are counted in
+// metadata.droppedEvents.
+NSString *KNodeTraceJSON();
+
+// Write the recorded events as Chrome trace-event JSON to |path|
+BOOL KNodeTraceWriteToFile(NSString *path);
+
+// Install GC hooks (must be called from node)
+void KNodeTraceInitNode();
+
+// Record a span. |category| and |name| must be string literals (or otherwise
+// live forever). |arg| is exported as args.size unless it's negative.
+void KNodeTraceRecord(const char *category, const char *name,
+                      uint64_t start, uint64_t end, int64_t arg=-1);
+
+// Current time in tracer units
+uint64_t KNodeTraceNow();
+
+
+// Records a span for the lifetime of the scope
+class KNodeTraceScope {
+ public:
+  KNodeTraceScope(const char *category, const char *name, int64_t arg=-1)
+      : name_(KNodeTraceEnabled ? name : NULL), category_(category), arg_(arg) {
+    if (name_) start_ = KNodeTraceNow();
+  }
+  ~KNodeTraceScope() {
+    if (name_) KNodeTraceRecord(category_, name_, start_, KNodeTraceNow(), arg_);
+  }
+  inline void setArg(int64_t arg) { arg_ = arg; }
+ protected:
+  const char *name_;
+  const char *category_;
+  int64_t arg_;
+  uint64_t start_;
+};
+
+#define KNODE_TRACE_SCOPE(category, name) \
+  KNodeTraceScope __knode_trace_scope(category, name)
+
+// Trace a conversion of |size| elements, if it's large enough. |size| is
+// evaluated once.
+#define KNODE_TRACE_CONVERSION(name, size) \
+  int64_t __knode_trace_size = (int64_t)(size); \
+  KNodeTraceScope __knode_trace_scope("convert", \
+      (size_t)__knode_trace_size >= KNodeTraceConversionThreshold ? \
+          (name) : NULL, \
+      __knode_trace_size)
+
+#endif  // KNODE_TRACE_H_
@@ -0,0 +1,279 @@
+// Copyright (c) 2010-2011, Rasmus Andersson. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+#import "node_trace.h"
+#import "common.h"
+#import <v8.h>
+#import <pthread.h>
+#import <mach/mach_time.h>
+
+volatile int32_t KNodeTraceEnabled = 0;
+size_t KNodeTraceConversionThreshold = 1024;
+
+// max number of events recorded per thread and session
+#define KNODE_TRACE_BUFFER_SIZE 8192
+
+struct KNodeTraceEvent {
+  const char *category;
+  const char *name;
+  uint64_t start;
+  uint64_t end;
+  int64_t arg;
+};
+
+// Events of one thread. Only the owning thread writes to a buffer, and
+// |count| is published after the event is written, so readers can safely
+// read the first |count| events without locking.
+struct KNodeTraceBuffer {
+  KNodeTraceBuffer *next;
+  int32_t session;
+  volatile int32_t count;
+  volatile int32_t dropped;
+  mach_port_t tid;
+  bool retired;  // owner has exited, kept until its events are discarded
+  char threadName[64];
+  KNodeTraceEvent events[KNODE_TRACE_BUFFER_SIZE];
+};
+
+// Buffers of live threads, and of exited threads holding events of the
+// current session. The list (but not the events) is guarded by
+// KNodeTraceBuffersLock, which recording never takes.
+static KNodeTraceBuffer *KNodeTraceBuffers = NULL;
+static pthread_mutex_t KNodeTraceBuffersLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Incremented by every start. Buffers of older sessions are reset lazily.
+static volatile int32_t KNodeTraceSession = 0;
+
+static pthread_key_t KNodeTraceBufferKey;
+static pthread_once_t KNodeTraceBufferKeyOnce = PTHREAD_ONCE_INIT;
+
+static mach_timebase_info_data_t KNodeTraceTimebase;
+
+// GC pause start
+static uint64_t KNodeTraceGCStart = 0;
+
+
+// Unlink and free |buffer|. Must be called with KNodeTraceBuffersLock held.
+static void _freeBuffer(KNodeTraceBuffer *buffer) {
+  KNodeTraceBuffer **p = &KNodeTraceBuffers;
+  while (*p && *p != buffer) p = &(*p)->next;
+  if (*p) *p = buffer->next;
+  free(buffer);
+}
+
+
+// Called when a thread which has recorded events exits. The buffer is freed
+// right away unless it holds events which might still be exported, in which
+// case it's freed by the next start.
+static void _retireBuffer(void *data) {
+  KNodeTraceBuffer *buffer = (KNodeTraceBuffer*)data;
+  pthread_mutex_lock(&KNodeTraceBuffersLock);
+  if (buffer->session == KNodeTraceSession && buffer->count > 0) {
+    buffer->retired = true;
+  } else {
+    _freeBuffer(buffer);
+  }
+  pthread_mutex_unlock(&KNodeTraceBuffersLock);
+}
+
+
+static void _initBufferKey() {
+  pthread_key_create(&KNodeTraceBufferKey, &_retireBuffer);
+  mach_timebase_info(&KNodeTraceTimebase);
+}
+
+
+static KNodeTraceBuffer *_currentBuffer() {
+  KNodeTraceBuffer *buffer =
+      (KNodeTraceBuffer*)pthread_getspecific(KNodeTraceBufferKey);
+  if (!buffer) {
+    buffer = (KNodeTraceBuffer*)calloc(1, sizeof(KNodeTraceBuffer));
+    buffer->tid = pthread_mach_thread_np(pthread_self());
+    if (pthread_main_np()) {
+      strcpy(buffer->threadName, "main");
+    } else if (pthread_getname_np(pthread_self(), buffer->threadName,
+                                  sizeof(buffer->threadName)) != 0 ||
+               buffer->threadName[0] == '\0') {
+      snprintf(buffer->threadName, sizeof(buffer->threadName), "thread %u",
+               buffer->tid);
+    }
+    // push onto the list of all buffers
+    pthread_mutex_lock(&KNodeTraceBuffersLock);
+    buffer->next = KNodeTraceBuffers;
+    KNodeTraceBuffers = buffer;
+    pthread_mutex_unlock(&KNodeTraceBuffersLock);
+    pthread_setspecific(KNodeTraceBufferKey, buffer);
+  }
+  return buffer;
+}
+
+
+uint64_t KNodeTraceNow() {
+  return mach_absolute_time();
+}
+
+
+void KNodeTraceRecord(const char *category, const char *name,
+                      uint64_t start, uint64_t end, int64_t arg) {
+  if (!KNodeTraceEnabled) return;
+  pthread_once(&KNodeTraceBufferKeyOnce, &_initBufferKey);
+  KNodeTraceBuffer *buffer = _currentBuffer();
+  int32_t session = KNodeTraceSession;
+  if (buffer->session != session) {
+    buffer->count = 0;
+    buffer->dropped = 0;
+    buffer->session = session;
+  }
+  int32_t i = buffer->count;
+  if (i == KNODE_TRACE_BUFFER_SIZE) {
+    ++buffer->dropped;
+    return;
+  }
+  KNodeTraceEvent *event = &buffer->events[i];
+  event->category = category;
+  event->name = name;
+  event->start = start;
+  event->end = end;
+  event->arg = arg;
+  h_atomic_barrier();
+  buffer->count = i + 1;
+}
+
+
+void KNodeTraceStart() {
+  pthread_once(&KNodeTraceBufferKeyOnce, &_initBufferKey);
+  // events of exited threads are discarded along with the previous session
+  pthread_mutex_lock(&KNodeTraceBuffersLock);
+  KNodeTraceBuffer *buffer = KNodeTraceBuffers;
+  while (buffer) {
+    KNodeTraceBuffer *next = buffer->next;
+    if (buffer->retired) _freeBuffer(buffer);
+    buffer = next;
+  }
+  pthread_mutex_unlock(&KNodeTraceBuffersLock);
+  // buffers are reset by their owners the first time they record in the new
+  // session, and buffers of older sessions are not exported
+  h_atomic_inc(&KNodeTraceSession);
+  h_atomic_barrier();
+  KNodeTraceEnabled = 1;
+}
+
+
+void KNodeTraceStop() {
+  KNodeTraceEnabled = 0;
+  h_atomic_barrier();
+}
+
+
+static inline uint64_t _toMicroseconds(uint64_t t) {
+  return (t * KNodeTraceTimebase.numer) / KNodeTraceTimebase.denom / 1000;
+}
+
+
+// Append |str| to |json| as a quoted JSON string
+static void _appendJSONString(NSMutableString *json, const char *str) {
+  [json appendString:@"\""];
+  for (const char *p = str; *p; ++p) {
+    unsigned char c = (unsigned char)*p;
+    if (c == '"' || c == '\\') {
+      [json appendFormat:@"\\%c", c];
+    } else if (c < 0x20) {
+      [json appendFormat:@"\\u%04x", c];
+    } else {
+      // thread names are UTF-8, so pass multibyte sequences through as-is
+      const char *start = p;
+      while (p[1] && (unsigned char)p[1] >= 0x20 && p[1] != '"' && p[1] != '\\')
+        ++p;
+      NSString *run = [[NSString alloc] initWithBytes:start length:p - start + 1
+                                             encoding:NSUTF8StringEncoding];
+      if (run) [json appendString:run];
+      [run release];
+    }
+  }
+  [json appendString:@"\""];
+}
+
+
+NSString *KNodeTraceJSON() {
+  pthread_once(&KNodeTraceBufferKeyOnce, &_initBufferKey);
+  NSMutableString *json = [NSMutableString stringWithString:@"{\"traceEvents\":["];
+  NSMutableString *dropped = [NSMutableString string];
+  int64_t droppedTotal = 0;
+  int pid = getpid();
+  int32_t session = KNodeTraceSession;
+  BOOL first = YES;
+  pthread_mutex_lock(&KNodeTraceBuffersLock);
+  h_atomic_barrier();
+  for (KNodeTraceBuffer *buffer = KNodeTraceBuffers; buffer;
+       buffer = buffer->next) {
+    int32_t count = buffer->count;
+    if (buffer->session != session || count == 0) continue;
+
+    [json appendFormat:@"%@{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                        "\"tid\":%u,\"args\":{\"name\":",
+                       first ? @"" : @",", pid, buffer->tid];
+    _appendJSONString(json, buffer->threadName);
+    [json appendString:@"}}"];
+    first = NO;
+
+    for (int32_t i = 0; i < count; ++i) {
+      KNodeTraceEvent *event = &buffer->events[i];
+      uint64_t ts = _toMicroseconds(event->start);
+      uint64_t dur = _toMicroseconds(event->end) - ts;
+      [json appendFormat:@",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                          "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%u",
+                         event->name, event->category, ts, dur, pid,
+                         buffer->tid];
+      if (event->arg >= 0)
+        [json appendFormat:@",\"args\":{\"size\":%lld}", event->arg];
+      [json appendString:@"}"];
+    }
+
+    if (buffer->dropped) {
+      WLOG("[trace] dropped %d events on thread '%s'", buffer->dropped,
+           buffer->threadName);
+      [dropped appendFormat:@"%@\"%u\":%d", [dropped length] ? @"," : @"",
+                            buffer->tid, buffer->dropped];
+      droppedTotal += buffer->dropped;
+    }
+  }
+  pthread_mutex_unlock(&KNodeTraceBuffersLock);
+  // events which did not fit in their thread's buffer, in total and by tid
+  [json appendFormat:@"],\"displayTimeUnit\":\"ms\",\"metadata\":{"
+                      "\"droppedEvents\":%lld,\"droppedEventsByThread\":{%@}}}",
+                     droppedTotal, dropped];
+  return json;
+}
+
+
+BOOL KNodeTraceWriteToFile(NSString *path) {
+  NSError *error = nil;
+  BOOL ok = [KNodeTraceJSON() writeToFile:path atomically:YES
+                                 encoding:NSUTF8StringEncoding error:&error];
+  if (!ok)
+    WLOG("[trace] failed to write trace to %@: %@", path, error);
+  return ok;
+}
+
+
+static void _GCPrologue(v8::GCType type, v8::GCCallbackFlags flags) {
+  if (KNodeTraceEnabled) KNodeTraceGCStart = KNodeTraceNow();
+}
+
+
+static void _GCEpilogue(v8::GCType type, v8::GCCallbackFlags flags) {
+  if (KNodeTraceEnabled && KNodeTraceGCStart) {
+    KNodeTraceRecord("v8",
+                     type == v8::kGCTypeMarkSweepCompact ? "gc.marksweep"
+                                                         : "gc.scavenge",
+                     KNodeTraceGCStart, KNodeTraceNow());
+  }
+  KNodeTraceGCStart = 0;
+}
+
+
+void KNodeTraceInitNode() {
+  v8::V8::AddGCPrologueCallback(&_GCPrologue);
+  v8::V8::AddGCEpilogueCallback(&_GCEpilogue);
+}